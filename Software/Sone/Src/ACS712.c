@@ -39,11 +39,15 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include <string.h>
 
 #include "PortMacros.h"
 #include "ACS712.h"
+#include "ADC.h"
+#include "SG3525.h"
+#include "EEPROM.h"
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -54,23 +58,66 @@
 //////////////////////////////////////////////////////////////////////////////////////////
 
 //
-// Full Speed AtoD at 16mHz = 8710 samples per second
+// Full Speed AtoD at 16mHz = 9600 samples per second, less the slots given to the
+//   other channels (see ADC.h).
 //
-// With 25 Ticks per second, taking 1 in 10 measurements is about 34 measurements per
-//   tick, which gives us 10+5 = 15 bits of resolution.
+// Every current reading goes into the oversampling sum, and each 4^n readings make
+//   one output of 10+n bits (see ACS712_OVERSAMPLE). The outputs are totalled for
+//   ACS712Update().
 //
+#define SUM_READINGS    (1 << (2*ACS712_OVERSAMPLE))
+
 static struct {
     int16_t     Current;                            // Measured current, in Amps*10
-    uint16_t    Total;                              // Total AtoD in counted cycles
-    uint8_t     Cycles;                             // Number of cycles in total
-    uint8_t     SkipCount;                          // Cycles until next measurement
+    int16_t     CurrentFine;                        // Measured current, in Amps*100
+    uint16_t    Counts;                             // Average reading, counts x 64
+    uint32_t    Total;                              // Total of oversampled outputs
+    uint8_t     Cycles;                             // Number of outputs in total
+    uint16_t    Sum;                                // Sum of readings for next output
+    uint8_t     SumCount;                           // Readings until next output
+    uint16_t    Peak;                               // Highest reading, forward counts
+    uint16_t    Trips;                              // Number of overcurrent trips
+    uint16_t    TripADC;                            // Trip level, forward counts
+    bool        Tripped;                            // TRUE if tripped, until cleared
+    uint16_t    SupplyCounts;                       // Average supply reading, x 64
+    uint16_t    SupplyFilter;                       // Supply volts x 100, filtered
     } ACS712 NOINIT;
-
-#define START_ATOD  { _SET_BIT(ADCSRA,ADSC); }      // Start the AtoD conversion
-#define ADMUX_VAL   (_PIN_MASK(REFS0) + ACS712_CHANNEL)
-
-#define DISABLE_INT _CLR_BIT(ADCSRA,_PIN_MASK(ADIE));   // Disable AtoD interrupts
-#define ENABLE_INT  _SET_BIT(ADCSRA,_PIN_MASK(ADIE));   // Enable  AtoD interrupts
+
+#define MAX_ADC 0x3FF
+#define VADC    500             // == 5 volts x 100
+
+//
+// Readings in the "forward" direction, where more current is a higher count. The
+//   trip level is worked out ahead of time, so the ISR only has to compare.
+//
+#ifdef ACS712_REVERSE
+#define FORWARD(_adc_)  (MAX_ADC - (_adc_))
+#define FORWARD64(_c_)  ((uint16_t) (MAX_ADC*64U - (_c_)))
+#else
+#define FORWARD(_adc_)  (_adc_)
+#define FORWARD64(_c_)  (_c_)
+#endif
+
+//
+// Ideal calibration: zero current at mid scale, and a 5 volt reference
+//
+#define IDEAL_ZERO          ((uint16_t) (MAX_ADC*32))
+#define IDEAL_CURRENT_GAIN  ((uint16_t) ((VADC*65536UL + MAX_ADC/2)/MAX_ADC))
+#define IDEAL_SUPPLY_GAIN   ((uint16_t) ((VADC*4096ULL*(SUPPLY_R1+SUPPLY_R2) + \
+                                          MAX_ADC*SUPPLY_R2/2UL)/(MAX_ADC*(uint64_t) SUPPLY_R2)))
+
+//
+// Reciprocals for averaging, 65536/n. There are normally 5 or 6 outputs per update
+//   (22 or so with ACS712_OVERSAMPLE at 1), and the table allows some slack.
+//
+#define MAX_RECIP   32
+
+static const uint16_t Recip[MAX_RECIP+1] PROGMEM = {
+    0, 65535, 32768, 21845, 16384, 13107, 10923, 9362, 8192,
+    7282, 6554, 5958, 5461, 5041, 4681, 4369, 4096,
+    3855, 3641, 3449, 3277, 3121, 2979, 2849, 2731,
+    2621, 2521, 2427, 2341, 2260, 2185, 2114, 2048,
+    };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -85,26 +132,13 @@ void ACS712Init(void) {
 
     memset(&ACS712,0,sizeof(ACS712));
 
-    ACS712.SkipCount = ACS712_SKIP;
-
-    //
-    // Setup AtoD channels for input
-    //
-    _CLR_BIT(PRR,PRADC);                    // Powerup the A/D converter
-
-    DIDR0  = 0;                             // Turn off digital outputs
-    ADCSRB = 0;                             // Free running mode
-    ADMUX  = ADMUX_VAL;                     // AVCC as ref, number of channels
-    ADCSRA = _PIN_MASK(ADPS2) | 
-             _PIN_MASK(ADPS1) | 
-             _PIN_MASK(ADPS0) |             // Prescale to 150 KHz
-             _PIN_MASK(ADEN)  |             // Enable, enable ints
-             _PIN_MASK(ADIE);
+    ACS712.SumCount = SUM_READINGS;
 
     //
-    // Start the conversions
+    // The EEPROM isn't loaded yet, so trip at the ideal level until it is
     //
-    START_ATOD;
+    ACS712.TripADC = FORWARD64(IDEAL_ZERO)/64 +
+                     ((uint32_t) ACS712_TRIP_CURRENT << 16)/IDEAL_CURRENT_GAIN;
     }
 
 
@@ -118,35 +152,247 @@ void ACS712Init(void) {
 // Outputs:     ACS712 Current in Amps*10
 //
 void ACS712Update(void) {
+    uint32_t ACS712Total;
+    uint8_t  ACS712Cycles;
 
-    DISABLE_INT;
+    //
+    // With interrupts off, not just ADIE masked: an AtoD ISR already running when
+    //   ADIE is cleared would still finish, and write back the total we just zeroed.
+    //
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ACS712Total   = ACS712.Total;
+        ACS712Cycles  = ACS712.Cycles;
+        ACS712.Total  = 0;
+        ACS712.Cycles = 0;
+        }
 
-    int16_t ACS712Total  = ACS712.Total;
-    uint8_t ACS712Cycles = ACS712.Cycles;
+    //
+    // The supply voltage filter starts from the first reading, so that we don't start
+    //   out looking under voltage.
+    //
+    ACS712.SupplyCounts = ADCGetCounts(ADC_SUPPLY);
 
-    ACS712.Total  = 0;
-    ACS712.Cycles = 0;
+    if( ACS712.SupplyCounts ) {
+        uint16_t Volts = ACS712ToSupply(ACS712.SupplyCounts);
 
-    ENABLE_INT;
+        if( ACS712.SupplyFilter == 0 )
+            ACS712.SupplyFilter = Volts << SUPPLY_FILTER_SHIFT;
+        else ACS712.SupplyFilter += Volts - (ACS712.SupplyFilter >> SUPPLY_FILTER_SHIFT);
+        }
 
     //
-    // The AtoD reading is proportional to 1023 with 
+    // No readings this time around (short update interval), keep the previous value
+    //
+    if( ACS712Cycles == 0 )
+        return;
 
-#define MAX_ADC 0x3FF
-#define VADC    500             // == 5 volts x 100
+    ACS712.Counts      = ACS712Average(ACS712Total,ACS712Cycles,ACS712_OVERSAMPLE);
+    ACS712.Current     = ACS712ToCurrent    (ACS712.Counts);
+    ACS712.CurrentFine = ACS712ToCurrentFine(ACS712.Counts);
+    }
 
-    int32_t Voltage = (((int32_t) ACS712Total)*VADC)/(MAX_ADC*ACS712Cycles);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712Average - Average a total of AtoD readings
+//
+// Inputs:      Total of readings
+//              Number of readings
+//              Extra bits in each reading, from oversampling
+//
+// Outputs:     Average reading (counts x 64), rounded
+//
+uint16_t ACS712Average(uint32_t Total,uint8_t Cycles,uint8_t Extra) {
+    uint8_t Shift = 10 + Extra;
 
     //
-    // In normal  mode, a reading of 512 represents zero and positive current is greater.
-    //
-    // In reverse mode, 512 represents zero and positive current is lessor
+    // Too many to look up only happens if updates stop for a while. Otherwise the
+    //   product is about average x 65536, which fits in 32 bits for up to 16 bits
+    //   of average.
     //
-#ifdef ACS712_REVERSE
-    ACS712.Current = 250 - Voltage;
-#else
-    ACS712.Current = Voltage - 250;
-#endif
+    if( Cycles > MAX_RECIP )
+        return (Total << (6 - Extra))/Cycles;
+
+    return (Total*pgm_read_word(&Recip[Cycles]) + (1UL << (Shift-1))) >> Shift;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ToCurrent - Convert an average current reading to current
+//
+// Inputs:      Average reading (counts x 64)
+//
+// Outputs:     Current (amps x 10), rounded
+//
+// In normal  mode, a reading above zero is positive current.
+//
+// In reverse mode, a reading below zero is positive current.
+//
+int16_t ACS712ToCurrent(uint16_t Counts) {
+    int32_t Diff = (int32_t) FORWARD64(Counts) - FORWARD64(EEPROM.Cal.CurrentZero);
+
+    return (Diff*EEPROM.Cal.CurrentGain + (1L << 21)) >> 22;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ToCurrentFine - Convert an average current reading to current, to 10 mA
+//
+// Inputs:      Average reading (counts x 64)
+//
+// Outputs:     Current (amps x 100), rounded
+//
+// As ACS712ToCurrent, but there's no room left in 32 bits to multiply by 10. Work in
+//   amps x 80 instead, then x 5/4 gets to amps x 100.
+//
+int16_t ACS712ToCurrentFine(uint16_t Counts) {
+    int32_t Diff = (int32_t) FORWARD64(Counts) - FORWARD64(EEPROM.Cal.CurrentZero);
+    int32_t Amps80 = (Diff*EEPROM.Cal.CurrentGain + (1L << 18)) >> 19;
+
+    return (Amps80*5 + 2) >> 2;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ToSupply - Convert an average supply reading to volts
+//
+// Inputs:      Average reading (counts x 64)
+//
+// Outputs:     Supply voltage (volts x 100), rounded
+//
+uint16_t ACS712ToSupply(uint16_t Counts) {
+
+    return ((uint32_t) Counts*EEPROM.Cal.SupplyGain + (1L << 17)) >> 18;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetCounts - Return last average current reading (counts x 64)
+// ACS712GetSupplyCounts - Return last average supply reading (counts x 64)
+//
+// Inputs:      None
+//
+// Outputs:     As above
+//
+uint16_t ACS712GetCounts(void)       { return ACS712.Counts; }
+uint16_t ACS712GetSupplyCounts(void) { return ACS712.SupplyCounts; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ResetCal - Set the calibration to the ideal values
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+void ACS712ResetCal(void) {
+
+    EEPROM.Cal.CurrentZero = IDEAL_ZERO;
+    EEPROM.Cal.CurrentGain = IDEAL_CURRENT_GAIN;
+    EEPROM.Cal.SupplyGain  = IDEAL_SUPPLY_GAIN;
+
+    ACS712UseCal();
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712CalZero    - Calibrate the zero current reading
+// ACS712CalCurrent - Calibrate the current gain against a known current
+// ACS712CalSupply  - Calibrate the supply gain against a known voltage
+//
+// Inputs:      Actual current (amps x 10), or voltage (volts x 100)
+//
+// Outputs:     TRUE  if calibrated
+//              FALSE if the reading won't give a sensible calibration
+//
+// Calibration uses the most recent average reading, so the transducer must be off
+//   for the zero, and running at a steady current for the gain. The zero should be
+//   done first.
+//
+// NOTE: Only changes the RAM copy, caller must update the EEPROM.
+//
+bool ACS712CalZero(void) {
+
+    EEPROM.Cal.CurrentZero = ACS712.Counts;
+    ACS712UseCal();
+    return true;
+    }
+
+
+bool ACS712CalCurrent(int16_t Current) {
+    int16_t  Diff = FORWARD64(ACS712.Counts) - FORWARD64(EEPROM.Cal.CurrentZero);
+
+    if( Current <= 0 || Diff <= 0 )
+        return false;
+
+    uint32_t Gain = (((uint32_t) Current << 22) + Diff/2)/Diff;
+
+    if( Gain > UINT16_MAX )
+        return false;
+
+    EEPROM.Cal.CurrentGain = Gain;
+    ACS712UseCal();
+    return true;
+    }
+
+
+bool ACS712CalSupply(uint16_t Volts) {
+
+    if( Volts == 0 || ACS712.SupplyCounts == 0 )
+        return false;
+
+    uint32_t Gain = (((uint32_t) Volts << 18) + ACS712.SupplyCounts/2)/ACS712.SupplyCounts;
+
+    if( Gain > UINT16_MAX )
+        return false;
+
+    EEPROM.Cal.SupplyGain = Gain;
+    return true;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712UseCal - Start using the calibration in EEPROM.Cal
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// The ISR checks raw readings against the trip level, so work out what reading the
+//   trip current gives with this calibration. That's the only divide, and it only
+//   happens here.
+//
+void ACS712UseCal(void) {
+
+    uint16_t Gain = EEPROM.Cal.CurrentGain;
+
+    if( Gain == 0 )
+        Gain = IDEAL_CURRENT_GAIN;
+
+    uint32_t Trip = FORWARD64(EEPROM.Cal.CurrentZero)/64 +
+                    ((uint32_t) ACS712_TRIP_CURRENT << 16)/Gain;
+
+    if( Trip > MAX_ADC )
+        Trip = MAX_ADC;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ACS712.TripADC = Trip;
+        }
     }
 
 
@@ -166,30 +412,135 @@ uint16_t ACS712GetCurrent(void) { return ACS712.Current; }
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// ADC_vect - A/D interrupt processing
+// ACS712GetCurrentFine - Return current value, to 10 mA
+//
+// Inputs:      None.
+//
+// Outputs:     ACS712 Current in Amps*100
+//
+int16_t ACS712GetCurrentFine(void) { return ACS712.CurrentFine; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetSupply - Return supply voltage
+//
+// Inputs:      None
+//
+// Outputs:     Filtered supply voltage (volts x 100)
+//
+uint16_t ACS712GetSupply(void) { return ACS712.SupplyFilter >> SUPPLY_FILTER_SHIFT; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
 //
-// Inputs:      None. (ISR)
+// ACS712Tripped - Return TRUE if an overcurrent trip has happened
+//
+// Inputs:      None
+//
+// Outputs:     TRUE if tripped since the last ACS712ClearTrip()
+//
+bool ACS712Tripped(void) { return ACS712.Tripped; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ClearTrip - Clear the overcurrent trip latch
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+void ACS712ClearTrip(void) {
+
+    ACS712.Tripped = false;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetTrips - Return number of overcurrent trips
+// ACS712GetPeak  - Return highest single reading (amps x 10)
+// ACS712ClearPeak- Clear the trip count and peak reading
+//
+// Inputs:      None
+//
+// Outputs:     As above
+//
+uint16_t ACS712GetTrips(void) {
+    uint16_t Trips;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        Trips = ACS712.Trips;
+        }
+
+    return Trips;
+    }
+
+int16_t ACS712GetPeak(void) {
+    uint16_t Peak;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        Peak = ACS712.Peak;
+        }
+
+    return ACS712ToCurrent(FORWARD64(Peak*64U));
+    }
+
+void ACS712ClearPeak(void) {
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ACS712.Peak  = 0;
+        ACS712.Trips = 0;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712Reading - Process one current reading
+//
+// Inputs:      AtoD reading
 //
 // Outputs:     None.
 //
-ISR(ADC_vect,ISR_NOBLOCK) {
+// NOTE: Called from the AtoD ISR (see ADC.c)
+//
+void ACS712Reading(uint16_t Reading) {
 
     //
-    // Start the next conversion
+    // Check every reading for overcurrent, and shut down the driver right away. The
+    //   transducer code sees the latch at the next control tick and cleans up.
     //
-    START_ATOD;
+    uint16_t Forward = FORWARD(Reading);
+
+    if( Forward > ACS712.TripADC ) {
+        SG3525_OFF;
+        if( !ACS712.Tripped ) {
+            ACS712.Tripped = true;
+            ACS712.Trips++;
+            }
+        }
+
+    if( Forward > ACS712.Peak )
+        ACS712.Peak = Forward;
 
     //
-    // Save resolution by only measuring 1-in-SKIP_MAX cycles
+    // Oversample: sum 4^n readings, then shift down by n for one output
     //
-    if( --ACS712.SkipCount > 0 )
+    ACS712.Sum += Reading;
+
+    if( --ACS712.SumCount > 0 )
         return;
 
-    ACS712.SkipCount = ACS712_SKIP;
+    ACS712.SumCount = SUM_READINGS;
 
-    //
-    // Total up the count and return
-    //
     ACS712.Cycles++;
-    ACS712.Total += ADC;
+    ACS712.Total += (ACS712.Sum + (SUM_READINGS >> (ACS712_OVERSAMPLE+1))) >> ACS712_OVERSAMPLE;
+    ACS712.Sum    = 0;
     }
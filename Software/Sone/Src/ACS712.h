@@ -14,7 +14,7 @@
 //      // In ACS712.h
 //      //
 //      ...Choose AtoD channel              (Default: ADC0)
-//      ...Choose skip count                (Default: 10)
+//      ...Choose oversampling              (Default: 2)
 //      ...Choose pos or neg mode           (Default: Neg)
 //      
 //      //////////////////////////////////////
@@ -23,6 +23,7 @@
 //      //
 //      TimerInit();
 //      ACS712Init();                       // Called once at startup
+//      ADCInit();                          // Start the AtoD (see ADC.h)
 //          :
 //
 //      while(1) {
@@ -71,6 +72,7 @@
 #define ACS712_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -79,7 +81,21 @@
 //
 //#define ACS712_CHANNEL  0     // See Config.h
 
-#define ACS712_SKIP     16                          // Count one out of every 10
+//
+// Oversampling. Every current reading is used: each 4^n readings are summed and
+//   shifted down by n, giving one output with n extra bits. The control frame then
+//   averages the outputs that came in during the frame.
+//
+// The AtoD runs at about 8500 current readings per second, so:
+//
+//      n   Readings    Output      Outputs per sec
+//      1      4        11 bits       2130
+//      2     16        12 bits        530
+//      3     64        13 bits        130
+//
+// The extra bits only come from noise on the readings, which the ACS712 has plenty of.
+//
+#define ACS712_OVERSAMPLE   2                       // n, from 1 to 3
 
 //
 // Uncomment this next if the current goes forward through the chip in the wrong
@@ -87,11 +103,46 @@
 //
 #define ACS712_REVERSE
 
+//
+// Overcurrent trip level. Every AtoD reading is checked against this, and the SG3525
+//   is shut off as soon as one goes over.
+//
+#define ACS712_TRIP_CURRENT 120                     // Trip current (amps x 10)
+
+//
+// Supply voltage sense. The driver supply comes in on SUPPLY_CHANNEL through a divider
+//   of SUPPLY_R1 (top) and SUPPLY_R2 (to ground), and is read by the AtoD scheduler
+//   (see ADC.c). The values below read up to 20 volts.
+//
+// The reading is filtered over 2^SUPPLY_FILTER_SHIFT updates.
+//
+#define SUPPLY_R1           10000                   // Divider top    resistor (ohms)
+#define SUPPLY_R2           3300                    // Divider bottom resistor (ohms)
+#define SUPPLY_FILTER_SHIFT 2
+
 //
 // End of user configurable options
 //
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
+//
+// Calibration, kept in the EEPROM (see EEPROM.h)
+//
+// Each update, the readings are averaged to 1/64th of an AtoD count, then
+//
+//      Current = (Counts - CurrentZero) x CurrentGain / 2^22     (amps x 10)
+//      Supply  =  Counts                x SupplyGain  / 2^18     (volts x 100)
+//
+//   with the current the other way round when ACS712_REVERSE. Uncalibrated values
+//   assume an exact 2.5 volt zero point and 5 volt reference (see ACS712ResetCal).
+//
+// None of this needs a divide, which is slow on the AVR.
+//
+typedef struct {
+    uint16_t    CurrentZero;    // Reading at zero current (counts x 64)
+    uint16_t    CurrentGain;    // Amps  x 10  per count   (x 2^16)
+    uint16_t    SupplyGain;     // Volts x 100 per count   (x 2^12)
+    } ACS712_CAL;
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -117,6 +168,20 @@ void ACS712Init(void);
 void ACS712Update(void);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712Reading - Process one current reading
+//
+// Inputs:      AtoD reading
+//
+// Outputs:     None.
+//
+// NOTE: Called from the AtoD ISR, not for public consumption
+//
+void ACS712Reading(uint16_t Reading);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -128,4 +193,144 @@ void ACS712Update(void);
 //
 uint16_t ACS712GetCurrent(void);
 
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetCurrentFine - Return current value, to 10 mA
+//
+// Inputs:      None
+//
+// Outputs:     Average current since last request (amps x 100)
+//
+int16_t ACS712GetCurrentFine(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetSupply - Return supply voltage
+//
+// Inputs:      None
+//
+// Outputs:     Filtered supply voltage (volts x 100), as of the last ACS712Update()
+//
+uint16_t ACS712GetSupply(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712Average   - Average a total of AtoD readings
+// ACS712ToCurrent - Convert an average current reading to current
+// ACS712ToCurrentFine - Convert an average current reading to current, to 10 mA
+// ACS712ToSupply  - Convert an average supply  reading to volts
+//
+// Inputs:      Total of readings, number of readings, and extra bits in each reading
+//                (0 for plain readings, ACS712_OVERSAMPLE for oversampled ones)
+//              Average reading (counts x 64)
+//
+// Outputs:     Average reading (counts x 64)
+//              Current (amps x 10), calibrated
+//              Current (amps x 100), calibrated
+//              Supply voltage (volts x 100), calibrated
+//
+// These are the stages of the conversion done by ACS712Update(). They depend only on
+//   their inputs and EEPROM.Cal, so can be tested off target.
+//
+uint16_t ACS712Average(uint32_t Total,uint8_t Cycles,uint8_t Extra);
+int16_t  ACS712ToCurrent(uint16_t Counts);
+int16_t  ACS712ToCurrentFine(uint16_t Counts);
+uint16_t ACS712ToSupply (uint16_t Counts);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetCounts - Return last average current reading (counts x 64)
+// ACS712GetSupplyCounts - Return last average supply reading (counts x 64)
+//
+// Inputs:      None
+//
+// Outputs:     As above, for calibration
+//
+uint16_t ACS712GetCounts(void);
+uint16_t ACS712GetSupplyCounts(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ResetCal - Set the calibration to the ideal values
+// ACS712UseCal   - Start using the calibration in EEPROM.Cal
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// NOTE: Only changes the RAM copy, caller must update the EEPROM. ACS712UseCal() must
+//         be called after any change to EEPROM.Cal, to move the overcurrent trip.
+//
+void ACS712ResetCal(void);
+void ACS712UseCal(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712CalZero    - Calibrate the zero current reading
+// ACS712CalCurrent - Calibrate the current gain against a known current
+// ACS712CalSupply  - Calibrate the supply gain against a known voltage
+//
+// Inputs:      Actual current (amps x 10), or voltage (volts x 100)
+//
+// Outputs:     TRUE  if calibrated
+//              FALSE if the reading won't give a sensible calibration
+//
+// NOTE: Only changes the RAM copy, caller must update the EEPROM.
+//
+bool ACS712CalZero(void);
+bool ACS712CalCurrent(int16_t Current);
+bool ACS712CalSupply(uint16_t Volts);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712Tripped - Return TRUE if an overcurrent trip has happened
+//
+// Inputs:      None
+//
+// Outputs:     TRUE if tripped since the last ACS712ClearTrip()
+//
+bool ACS712Tripped(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712ClearTrip - Clear the overcurrent trip latch
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+void ACS712ClearTrip(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ACS712GetTrips - Return number of overcurrent trips
+// ACS712GetPeak  - Return highest single reading (amps x 10)
+// ACS712ClearPeak- Clear the trip count and peak reading
+//
+// Inputs:      None
+//
+// Outputs:     As above
+//
+uint16_t ACS712GetTrips(void);
+int16_t  ACS712GetPeak(void);
+void     ACS712ClearPeak(void);
+
 #endif  // ACS712_H - entire file
@@ -92,6 +92,72 @@ static struct {
     }                                                                                       \
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// SendFreq - Send a frequency to the FREQ0 register
+//
+// Inputs:      Frequency of output
+//
+// Outputs:     None.
+//
+// NOTE: Caller must have set up the SPI for the AD9833 (see AD9833Output)
+//
+static void SendFreq(uint16_t Freq) {
+
+    //////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Calculate the clock divisor, per the AD9833 datasheet:
+    //
+    //   Freq    = (Divisor*CLKIN)/(2^28)
+    //   Divisor = Freq*(2^28)/CLKIN
+    //
+    // CLKIN in our application is 25,000,000, so (2^28)/CLKIN = 10.73741824
+    //
+    // That's 10 plus 48327/65536 (to within 1 part in 10^5), which is a multiply
+    //   instead of two long divides. This gets called from the control tick, so it
+    //   matters. F*48327 works for frequencies to 65535 without overflowing 32-bit
+    //   arithmetic.
+    //
+    union {
+        uint32_t    Long;           // Clock divisor, sent to chip
+        uint16_t    Words[2];       // Referenced as words
+        uint8_t     Bytes[4];       // Referenced as bytes
+        } Div;
+
+
+    Div.Long = (uint32_t) Freq*10 + (((uint32_t) Freq*48327 + 32768) >> 16);
+
+    //////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Calculate the frequency register highword and lowword
+    //
+    // Note: I normally avoid unions, but the generated code for shift/mask the Div
+    //         value is excessive. The compiler isn't smart enough to optimize bite-wise
+    //         shifts, so I do it here with a union.
+    //
+    union {
+        uint16_t    Word;
+        uint8_t     Bytes[2];
+        } FreqLow;                  // Low  order 14 bits of freq
+    union {
+        uint16_t    Word;
+        uint8_t     Bytes[2];
+        } FreqHigh;                 // High order 14 bits of freq
+
+    FreqLow .Word = FREQ0 | (Div.Words[0] & 0x3FFF);
+    FreqHigh.Word = FREQ0 | (Div.Words[1] << 2) | (Div.Bytes[1] >> 6);
+
+    //////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Send the data to the chip. With B28 set, the register changes when the high
+    //   word arrives, so the output never sees half a frequency.
+    //
+    SEND_2BYTES(FreqLow .Bytes[1],FreqLow .Bytes[0]);   // Low  14 bits frequency
+    SEND_2BYTES(FreqHigh.Bytes[1],FreqHigh.Bytes[0]);   // High 14-bits frequency
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -149,57 +215,7 @@ void AD9833Output(AD9833_MODE Mode,uint16_t Freq) {
     AD9833.Freq = Freq;
     AD9833.IsOn = true;
 
-    //////////////////////////////////////////////////////////////////////////////////////
-    //
-    // Calculate the clock divisor, per the AD9833 datasheet:
-    //
-    //   Freq    = (Divisor*CLKIN)/(2^28)
-    //   Divisor = Freq*(2^28)/CLKIN
-    //
-    // CLKIN in our application is 25,000,000
-    //
-    // (2^28)/CLKIN = (2^22)/(5^8)      (Factor out 2^6 in both numbers)
-    //
-    // The shift/div below works for frequencies to 65535 without
-    //   overflowing 32-bit arithmetic.
-    //
-    union {
-        uint32_t    Long;           // Clock divisor, sent to chip
-        uint16_t    Words[2];       // Referenced as words
-        uint8_t     Bytes[4];       // Referenced as bytes
-        } Div;
-
-
-    Div.Long = Freq;
-    Div.Long = (Div.Long << 14)/625;
-    Div.Long = (Div.Long <<  8)/625;
-
-    //////////////////////////////////////////////////////////////////////////////////////
-    //
-    // Calculate the frequency register highword and lowword
-    //
-    // Note: I normally avoid unions, but the generated code for shift/mask the Div
-    //         value is excessive. The compiler isn't smart enough to optimize bite-wise
-    //         shifts, so I do it here with a union.
-    //
-    union {
-        uint16_t    Word;
-        uint8_t     Bytes[2];
-        } FreqLow;                  // Low  order 14 bits of freq
-    union {
-        uint16_t    Word;
-        uint8_t     Bytes[2];
-        } FreqHigh;                 // High order 14 bits of freq
-
-    FreqLow .Word = FREQ0 | (Div.Words[0] & 0x3FFF);
-    FreqHigh.Word = FREQ0 | (Div.Words[1] << 2) | (Div.Bytes[1] >> 6);
-
-    //////////////////////////////////////////////////////////////////////////////////////
-    //
-    // Send the data to the chip
-    //
-    SEND_2BYTES(FreqLow .Bytes[1],FreqLow .Bytes[0]);   // Low  14 bits frequency
-    SEND_2BYTES(FreqHigh.Bytes[1],FreqHigh.Bytes[0]);   // High 14-bits frequency
+    SendFreq(Freq);
     SEND_2BYTES(PHASE0,0);                              // Set phase to zero
 
     if     ( Mode == AD9833_SIN ) { SEND_2BYTES(B28      ,0); }
@@ -209,6 +225,33 @@ void AD9833Output(AD9833_MODE Mode,uint16_t Freq) {
     SPCR = SavedSPCR;
     }
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// AD9833SetFreq - Change frequency of running output
+//
+// Inputs:      Frequency of output
+//
+// Outputs:     None.
+//
+// Unlike AD9833Output, this doesn't reset the chip, so the output carries on from
+//   the same phase at the new frequency. Only 2 SPI words are sent.
+//
+// NOTE: Output must already be on (see AD9833Output)
+//
+void AD9833SetFreq(uint16_t Freq) {
+
+    uint8_t SavedSPCR = SPCR;
+    _SET_BIT(SPCR,CPOL);
+    _CLR_BIT(SPCR,CPHA);
+
+    AD9833.Freq = Freq;
+    SendFreq(Freq);
+
+    SPCR = SavedSPCR;
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -118,6 +118,20 @@ void AD9833Init(void);
 void AD9833Output(AD9833_MODE Mode,uint16_t Freq);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// AD9833SetFreq - Change frequency of running output
+//
+// Inputs:      Frequency of output
+//
+// Outputs:     None.
+//
+// NOTE: Phase continuous, no reset glitch. Output must already be on.
+//
+void AD9833SetFreq(uint16_t Freq);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
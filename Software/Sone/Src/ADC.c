@@ -0,0 +1,402 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      ADC.c
+//
+//  SYNOPSIS
+//
+//      See ADC.h
+//
+//  DESCRIPTION
+//
+//      AtoD scheduler
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include <string.h>
+
+#include "PortMacros.h"
+#include "ADC.h"
+#include "ACS712.h"
+#include "SG3525.h"
+#include "Transducer.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data declarations
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#define REF_AVCC        (_PIN_MASK(REFS0))                      // AVCC as reference
+#define REF_1V1         (_PIN_MASK(REFS1) | _PIN_MASK(REFS0))   // Internal 1.1V
+#define REF_MASK        REF_1V1
+
+#define MUX_BANDGAP     0x0E                        // Internal 1.1V bandgap
+#define MUX_TEMP        0x08                        // Internal temperature sensor
+
+//
+// The channel list, in ADC_CHANNEL order.
+//
+//   Mux        ADMUX value for the channel, reference and input
+//   Every      Convert on one in this many turns (the current is always 1)
+//   Discard    Conversions to throw away after switching to the channel
+//
+// Channels that use a different reference than the current are only read while the
+//   transducer is off, since the current isn't being read while the reference
+//   settles. Switching back to the current after a reference change throws away
+//   ADC_REF_SETTLE readings, which can't be trusted even for the overcurrent trip, so
+//   TransducerOn() waits for them (see ADCHold). If the SG3525 comes on some other
+//   way partway through, the ISR goes straight back to the current.
+//
+typedef struct {
+    uint8_t     Mux;
+    uint8_t     Every;
+    uint8_t     Discard;
+    } ADC_SCHED;
+
+static const ADC_SCHED Sched[ADC_MAX_CHANNELS] PROGMEM = {
+    { REF_AVCC + ACS712_CHANNEL,  1,              0 },  // ADC_CURRENT
+    { REF_AVCC + SUPPLY_CHANNEL,  1,              0 },  // ADC_SUPPLY
+    { REF_AVCC + TUNING_CHANNEL,  1,              0 },  // ADC_TUNING
+    { REF_AVCC + MUX_BANDGAP,    16,              1 },  // ADC_VCC, bandgap settles slowly
+    { REF_1V1  + MUX_TEMP,      255, ADC_REF_SETTLE },  // ADC_TEMP, about once a second
+    };
+
+#define SCHED(_c_,_f_)  pgm_read_byte(&Sched[_c_]._f_)
+#define OTHER_REF(_c_)  ((SCHED(_c_,Mux) & REF_MASK) != REF_AVCC)
+
+//
+// If nobody empties a channel for a while, halve the total and count to make room
+//   and keep the average moving.
+//
+#define MAX_CYCLES      64
+
+typedef struct {
+    uint16_t    Total;                              // Total of readings
+    uint8_t     Cycles;                             // Number of readings in total
+    uint8_t     Turns;                              // Turns until next reading
+    uint16_t    Counts;                             // Last average, counts x 64
+    } ADC_ACC;
+
+static struct {
+    uint8_t     Chan;                               // Channel being converted
+    uint8_t     Discard;                            // Conversions left to throw away
+    uint8_t     SlotCount;                          // Current readings until next slot
+    uint8_t     Next;                               // Next channel to get a slot
+    bool        Hold;                               // TRUE to stay on AVCC
+    ADC_ACC     Acc[ADC_MAX_CHANNELS-1];            // All but the current
+    } AtoD NOINIT;
+
+#define ACC(_c_)    AtoD.Acc[(_c_)-1]
+
+#define START_ATOD  { ADCSRA = (ADCSRA & ADC_WRITE_MASK) | _PIN_MASK(ADSC); }  // Start conversion
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCInit - Initialize the AtoD and start converting
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void ADCInit(void) {
+
+    memset(&AtoD,0,sizeof(AtoD));
+
+    AtoD.Chan      = ADC_CURRENT;
+    AtoD.SlotCount = ADC_SLOT_EVERY;
+    AtoD.Next      = ADC_CURRENT+1;
+
+    for( uint8_t Chan = ADC_CURRENT+1; Chan < ADC_MAX_CHANNELS; Chan++ )
+        ACC(Chan).Turns = SCHED(Chan,Every);
+
+    //
+    // Setup AtoD channels for input
+    //
+    _CLR_BIT(PRR,PRADC);                    // Powerup the A/D converter
+
+    DIDR0  = _PIN_MASK(SUPPLY_CHANNEL) |    // Supply and tuning sense are analog only
+             _PIN_MASK(TUNING_CHANNEL);
+    ADCSRB = 0;                             // Free running mode
+    ADMUX  = SCHED(ADC_CURRENT,Mux);        // AVCC as ref, current channel
+    ADCSRA = _PIN_MASK(ADPS2) |
+             _PIN_MASK(ADPS1) |
+             _PIN_MASK(ADPS0) |             // Prescale to 150 KHz
+             _PIN_MASK(ADEN)  |             // Enable, enable ints
+             _PIN_MASK(ADIE);
+
+    //
+    // Start the conversions
+    //
+    START_ATOD;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCGetCounts - Return average reading of a channel
+//
+// Inputs:      Channel to return
+//
+// Outputs:     Average reading since the last ask (counts x 64)
+//
+uint16_t ADCGetCounts(ADC_CHANNEL Chan) {
+
+    if( Chan == ADC_CURRENT )
+        return ACS712GetCounts();
+
+    if( Chan >= ADC_MAX_CHANNELS )
+        return 0;
+
+    uint16_t Total;
+    uint8_t  Cycles;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        Total            = ACC(Chan).Total;
+        Cycles           = ACC(Chan).Cycles;
+        ACC(Chan).Total  = 0;
+        ACC(Chan).Cycles = 0;
+        }
+
+    if( Cycles )
+        ACC(Chan).Counts = ACS712Average(Total,Cycles,0);
+
+    return ACC(Chan).Counts;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCPeekCounts - Return average reading of a channel, without emptying the total
+//
+// Inputs:      Channel to return
+//
+// Outputs:     Average of the readings in the total (counts x 64), or the last
+//                average if the total is empty
+//
+uint16_t ADCPeekCounts(ADC_CHANNEL Chan) {
+
+    if( Chan == ADC_CURRENT )
+        return ACS712GetCounts();
+
+    if( Chan >= ADC_MAX_CHANNELS )
+        return 0;
+
+    uint16_t Total;
+    uint8_t  Cycles;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        Total  = ACC(Chan).Total;
+        Cycles = ACC(Chan).Cycles;
+        }
+
+    if( Cycles == 0 )
+        return ACC(Chan).Counts;
+
+    return ACS712Average(Total,Cycles,0);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCGetVcc - Return the supply to the processor, from the bandgap reading
+//
+// Inputs:      None
+//
+// Outputs:     Vcc (volts x 100), 0 if not read yet
+//
+// The bandgap is 1.1V against a reference of Vcc, so Vcc = 1.1 x 1024 / reading.
+//
+uint16_t ADCGetVcc(void) {
+    uint16_t Counts = ADCPeekCounts(ADC_VCC);
+
+    if( Counts == 0 )
+        return 0;
+
+    return (110UL*1024*64 + Counts/2)/Counts;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCGetTemp - Return the chip temperature
+//
+// Inputs:      None
+//
+// Outputs:     Temperature (degrees C), uncalibrated
+//
+int16_t ADCGetTemp(void) {
+
+    return (int16_t) ((ADCPeekCounts(ADC_TEMP) + 32) >> 6) - ADC_TEMP_OFFSET;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCHold - Keep the AtoD on the AVCC reference
+//
+// Inputs:      TRUE to hold, and wait for the reference to settle
+//              FALSE to let go
+//
+// Outputs:     None.
+//
+// Waits out any reading on another reference, and the settling after it, which can
+//   take about 10 ms.
+//
+// NOTE: Main loop only, with the AtoD interrupt enabled
+//
+void ADCHold(bool Hold) {
+    volatile uint8_t *Chan    = &AtoD.Chan;
+    volatile uint8_t *Discard = &AtoD.Discard;
+
+    AtoD.Hold = Hold;
+
+    if( !Hold )
+        return;
+
+    while( OTHER_REF(*Chan) || (*Chan == ADC_CURRENT && *Discard) )
+        ;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// NextSlot - Return channel to convert in the next slot
+//
+// Inputs:      None
+//
+// Outputs:     Channel to convert, or ADC_CURRENT if the channel whose turn it is
+//                isn't due
+//
+// Only one channel is looked at per slot, to keep the ISR short.
+//
+static inline uint8_t NextSlot(void) {
+    uint8_t Chan = AtoD.Next;
+
+    if( ++AtoD.Next >= ADC_MAX_CHANNELS )
+        AtoD.Next = ADC_CURRENT+1;
+
+    if( OTHER_REF(Chan) && (AtoD.Hold || TransducerCurr.On || SG3525_IS_ON) )
+        return ADC_CURRENT;
+
+    if( --ACC(Chan).Turns > 0 )
+        return ADC_CURRENT;
+
+    ACC(Chan).Turns = SCHED(Chan,Every);
+
+    return Chan;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADC_vect - A/D interrupt processing
+//
+// Inputs:      None. (ISR)
+//
+// Outputs:     None.
+//
+// Blocking, and short, so nothing else ever sees a total half updated.
+//
+ISR(ADC_vect) {
+    uint16_t Reading = ADC;
+    uint8_t  Chan    = AtoD.Chan;
+
+    //
+    // Off on another reference when the SG3525 comes on, go straight back to the
+    //   current and let the reference settle there.
+    //
+    if( Chan != ADC_CURRENT && OTHER_REF(Chan) && SG3525_IS_ON ) {
+        ADMUX        = SCHED(ADC_CURRENT,Mux);
+        AtoD.Discard = ADC_REF_SETTLE;
+        AtoD.Chan    = ADC_CURRENT;
+        START_ATOD;
+        return;
+        }
+
+    //
+    // Still settling after a switch, convert the same channel again
+    //
+    if( AtoD.Discard ) {
+        AtoD.Discard--;
+        START_ATOD;
+        return;
+        }
+
+    //
+    // Pick the next channel and start the conversion: normally the current, with a
+    //   slot for one of the others every ADC_SLOT_EVERY current readings.
+    //
+    uint8_t Next = ADC_CURRENT;
+
+    if( Chan == ADC_CURRENT && --AtoD.SlotCount == 0 ) {
+        AtoD.SlotCount = ADC_SLOT_EVERY;
+        Next           = NextSlot();
+        }
+
+    if( Next != Chan ) {
+        ADMUX        = SCHED(Next,Mux);
+        AtoD.Discard = Next != ADC_CURRENT ? SCHED(Next,Discard) :
+                       OTHER_REF(Chan)     ? ADC_REF_SETTLE      : 0;
+        AtoD.Chan    = Next;
+        }
+
+    START_ATOD;
+
+    //
+    // Current goes to the ACS712 code, which checks it for overcurrent right away
+    //
+    if( Chan == ADC_CURRENT ) {
+        ACS712Reading(Reading);
+        return;
+        }
+
+    if( ACC(Chan).Cycles >= MAX_CYCLES ) {
+        ACC(Chan).Total  >>= 1;
+        ACC(Chan).Cycles >>= 1;
+        }
+
+    ACC(Chan).Total += Reading;
+    ACC(Chan).Cycles++;
+    }
@@ -0,0 +1,201 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      ADC.h
+//
+//  SYNOPSIS
+//
+//      //////////////////////////////////////
+//      //
+//      // In ADC.c
+//      //
+//      ...Choose channel list and rates    (See Sched[])
+//
+//      //////////////////////////////////////
+//      //
+//      // In Main.c
+//      //
+//      ACS712Init();
+//      ADCInit();                          // Called once at startup
+//          :
+//
+//      Counts = ADCPeekCounts(ADC_TUNING); // Avg of recent readings    (counts x 64)
+//      Volts  = ADCGetVcc();               // Vcc, from the bandgap      (volts x 100)
+//      Temp   = ADCGetTemp();              // Chip temperature          (degrees C)
+//
+//  DESCRIPTION
+//
+//      AtoD scheduler
+//
+//      The AtoD runs flat out, converting the ACS712 current almost all the time. Every
+//        ADC_SLOT_EVERY current readings a slot goes to the next of the other channels,
+//        round robin, and each channel takes one in so many of its turns.
+//
+//      Current readings go straight to ACS712Reading(), for the overcurrent trip. The
+//        other channels are totalled here, and averaged when asked for.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef ADC_H
+#define ADC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Channels, in the same order as Sched[] in ADC.c. The current must be first.
+//
+typedef enum {
+    ADC_CURRENT = 0,                // ACS712 current       (ACS712_CHANNEL)
+    ADC_SUPPLY,                     // Driver supply        (SUPPLY_CHANNEL)
+    ADC_TUNING,                     // Transducer tuning    (TUNING_CHANNEL)
+    ADC_VCC,                        // Internal bandgap, against AVCC
+    ADC_TEMP,                       // Internal temperature sensor, against 1.1V
+    ADC_MAX_CHANNELS,
+    } ADC_CHANNEL;
+
+//
+// One slot for the other channels every ADC_SLOT_EVERY current readings. With 4
+//   other channels, each gets a turn about 250 times a second.
+//
+#define ADC_SLOT_EVERY      8
+
+//
+// Conversions to throw away after changing the reference. The Nano has a cap on
+//   AREF, which takes a few ms to settle (each conversion is about 100 us).
+//
+#define ADC_REF_SETTLE      48
+
+//
+// Rough temperature sensor offset: about 1 count per degree C, reading 324 at 0 C.
+//   Each chip is different by +/- 10 degrees.
+//
+#define ADC_TEMP_OFFSET     324
+
+//
+// End of user configurable options
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// ADIF is cleared by writing a 1 to it, so writes to ADCSRA must write it back as 0.
+//   Otherwise a conversion that has finished loses its interrupt, and since the ISR is
+//   what starts the next conversion, the AtoD stops for good.
+//
+// The totals are read with interrupts off (ATOMIC_BLOCK), not by masking ADIE.
+//
+#define ADC_WRITE_MASK      (~_PIN_MASK(ADIF))
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCInit - Initialize the AtoD and start converting
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Call after ACS712Init(), which the current readings go to.
+//
+void ADCInit(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCGetCounts - Return average reading of a channel
+//
+// Inputs:      Channel to return
+//
+// Outputs:     Average reading since the last ask (counts x 64), or the previous
+//                average if there are no readings since then. 0 if never read.
+//
+// The current returns the average as of the last ACS712Update().
+//
+// NOTE: This empties the channel's total, so only the one owner of a channel should
+//         use it (ACS712Update() for the supply). Everyone else uses ADCPeekCounts().
+//
+uint16_t ADCGetCounts(ADC_CHANNEL Chan);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCPeekCounts - Return average reading of a channel, without emptying the total
+//
+// Inputs:      Channel to return
+//
+// Outputs:     Average of the readings in the total (counts x 64), or the last
+//                average if the total is empty. 0 if never read.
+//
+// NOTE: The current and supply are updated by the control tick, so call this with
+//         control disabled from the main loop (see Control.h).
+//
+uint16_t ADCPeekCounts(ADC_CHANNEL Chan);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCGetVcc  - Return the supply to the processor, from the bandgap reading
+// ADCGetTemp - Return the chip temperature
+//
+// Inputs:      None
+//
+// Outputs:     Vcc (volts x 100), 0 if not read yet
+//              Temperature (degrees C), uncalibrated
+//
+// The bandgap is only good to +/- 10%, and the temperature to +/- 10 degrees, but both
+//   are good for seeing changes.
+//
+uint16_t ADCGetVcc(void);
+int16_t  ADCGetTemp(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ADCHold - Keep the AtoD on the AVCC reference
+//
+// Inputs:      TRUE to hold, and wait for the reference to settle
+//              FALSE to let go
+//
+// Outputs:     None.
+//
+// Readings right after a reference change are wrong, and the current isn't read at
+//   all on the 1.1V reference, so the output mustn't come on until it has settled.
+//   The 1.1V channels aren't read while the transducer is on.
+//
+// NOTE: Main loop only, with the AtoD interrupt enabled
+//
+void ADCHold(bool Hold);
+
+#endif  // ADC_H - entire file
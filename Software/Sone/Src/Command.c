@@ -255,6 +255,28 @@ void Command(char *Buffer) {
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+#ifdef USE_FAULT_SCREEN
+    //
+    // FA - Show the fault screen
+    //
+    if( StrEQ(Command,"FA") ) {
+        ShowScreen('FA');
+        return;
+        }
+
+#ifdef USE_FAULT_SCREEN_CMDS
+    //
+    // See if the local screen can manage the command
+    //
+    if( SelectedScreen == 'FA' ) {
+        if( FAScreenCommand(Command) )
+            return;
+        }
+#endif
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 #ifdef USE_MEMORY_SCREEN
     //
     // ME - Show the memory screen
@@ -87,7 +87,7 @@
 // Maximum size of an input entry.  In other words, the maximum number of characters
 //   that can be entered on a single line for input over the serial port.
 //
-#define MAX_CMD_LENGTH      20
+#define MAX_CMD_LENGTH      32
 
 //
 // Any character in the following is a delimiter character. Delimiters come between
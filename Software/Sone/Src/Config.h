@@ -49,7 +49,7 @@
 //
 // EEPROM memory layout
 //
-#define EEPROM_CURR_VERSION 7
+#define EEPROM_CURR_VERSION 23
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -66,7 +66,7 @@
 //
 //      PORTC.7     LEDs    LED1
 //      PORTC.6     LEDs    LED2
-//      PORTC.5
+//      PORTC.5     SUPPLY  Supply voltage sense (AtoD)
 //      PORTC.4     TUNING  Tuning relay
 //      PORTC.3     OUTPUTS O2
 //      PORTC.2     OUTPUTS O1
@@ -95,6 +95,13 @@
 //
 #define ACS712_CHANNEL      0           // PortC.0
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Supply voltage sense, through a divider (see ACS712.h)
+//
+#define SUPPLY_CHANNEL      5           // PortC.5
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -121,14 +128,6 @@
 #define TUNE_RELAY_PORT     C           // PortC
 #define TUNE_RELAY_BIT      4           // Pin 4
 
-//////////////////////////////////////////////////////////////////////////////////////////
-//////////////////////////////////////////////////////////////////////////////////////////
-//
-// Unused bits in PortC
-//
-#define UNUSEDC2_PORT       C           // PortC
-#define UNUSEDC2_BIT        5           // Pin 5
-
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -0,0 +1,181 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Control.c
+//
+//  DESCRIPTION
+//
+//      Fast control tick
+//
+//      Setup a timer to call the transducer control code at a fixed rate.
+//
+//      See Control.h for an in-depth description
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#include <avr\io.h>
+#include <avr\interrupt.h>
+
+#include "Control.h"
+#include "Transducer.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data declarations
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static struct {
+    uint16_t    Overruns;                           // Ticks dropped due to overrun
+    uint16_t    MaxCycles;                          // Longest tick, in CPU cycles
+    bool        Busy;                               // TRUE while control code runs
+    } Control NOINIT;
+
+#define PRTIMx          _PRTIM(CONTROL_TIMER_ID)
+#define CONTROL_ISR     _TCOMPA_VECT(CONTROL_TIMER_ID)
+
+#define TCNTx           _TCNT(CONTROL_TIMER_ID)
+#define TCCRAx          _TCCRA(CONTROL_TIMER_ID)
+#define TCCRBx          _TCCRB(CONTROL_TIMER_ID)
+#define OCRAx           _OCRA(CONTROL_TIMER_ID)
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlInit - Initialize and start the control tick
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void ControlInit(void) {
+
+    memset(&Control,0,sizeof(Control));
+
+    _CLR_BIT(PRR,PRTIMx);           // Powerup the clock
+
+    //
+    // Setup the timer as free running, with OCRA as top value
+    //
+    TCCRAx = CONTROL_CTC_MODE;      // No output compare functions
+    TCCRBx = CONTROL_CLOCK_BITS;    // Set appropriate clock
+    TCNTx  = 0;
+    OCRAx  = CONTROL_CLOCK_COUNT-1; // And clock count for ticks
+
+    ENABLE_CONTROL;                 // Allow interrupts
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlGetOverruns - Return number of control ticks dropped due to overrun
+//
+// Inputs:      None.
+//
+// Outputs:     Number of overruns since ControlInit()
+//
+uint16_t ControlGetOverruns(void) {
+    uint16_t Rtnval;
+
+    DISABLE_CONTROL;                // Disable interrupts
+    Rtnval = Control.Overruns;
+    ENABLE_CONTROL;                 // Allow interrupts
+
+    return Rtnval;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlGetMaxCycles - Return longest control tick, in CPU cycles
+// ControlClearCycles  - Start the measurement over
+//
+// Inputs:      None.
+//
+// Outputs:     Longest tick since ControlInit() or ControlClearCycles()
+//
+uint16_t ControlGetMaxCycles(void) {
+    uint16_t Rtnval;
+
+    DISABLE_CONTROL;                // Disable interrupts
+    Rtnval = Control.MaxCycles;
+    ENABLE_CONTROL;                 // Allow interrupts
+
+    return Rtnval;
+    }
+
+
+void ControlClearCycles(void) {
+
+    DISABLE_CONTROL;                // Disable interrupts
+    Control.MaxCycles = 0;
+    ENABLE_CONTROL;                 // Allow interrupts
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TIMERx_COMPA_vect - Control tick
+//
+// Inputs:      None. (ISR)
+//
+// Outputs:     None.
+//
+// NOTE: Other interrupts are enabled while the control code runs, including this one.
+//         If we come back in while still busy, the previous tick overran.
+//
+ISR(CONTROL_ISR,ISR_NOBLOCK) {
+
+    if( Control.Busy ) {
+        Control.Overruns++;
+        return;
+        }
+
+    //
+    // Timer1 counts CPU cycles for the PWM measurement (see PWM.c), so use it to time
+    //   the control code. Interrupts taken while we run are included.
+    //
+    uint16_t Start = TCNT1;
+
+    Control.Busy = true;
+    TransducerControl();
+    Control.Busy = false;
+
+    uint16_t Cycles = TCNT1 - Start;
+
+    if( Cycles > Control.MaxCycles )
+        Control.MaxCycles = Cycles;
+    }
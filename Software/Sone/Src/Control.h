@@ -0,0 +1,171 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Control.h
+//
+//  SYNOPSIS
+//
+//      //////////////////////////////////////
+//      //
+//      // In Control.h
+//      //
+//      ...Choose a timer                  (Default: Timer0)
+//      ...Choose tick rate                (Default: 1 KHz)
+//      ...Choose measurement frame        (Default: 10 ticks)
+//
+//      //////////////////////////////////////
+//      //
+//      // In Main.c
+//      //
+//      TransducerInit();
+//      SetupInit();
+//          :
+//      ControlInit();                      // Start the control tick
+//
+//      //////////////////////////////////////
+//      //
+//      // Anywhere outside the control tick
+//      //
+//      DISABLE_CONTROL;                    // Keep the control tick out
+//          :                               // ...change things it uses
+//      ENABLE_CONTROL;                     // Let it run again
+//
+//      uint16_t Overruns = ControlGetOverruns();
+//
+//  DESCRIPTION
+//
+//      Fast control tick
+//
+//      Measurement and actuation of the transducer need to happen at a steady pace,
+//        and much faster than the 25 Hz user interface tick in Timer.c. Screen updates
+//        and command processing can take a good part of a UI tick, and anything run
+//        from the main loop gets delayed by them.
+//
+//      This module runs a second hardware timer, and calls TransducerControl() from
+//        the timer interrupt at each control tick. The interrupt is declared
+//        ISR_NOBLOCK so that the PWM capture and AtoD interrupts can still get in.
+//
+//      If the control code hasn't finished when the next tick comes around, that tick
+//        is dropped and counted as an overrun.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "TimerMacros.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Specify a timer to use
+//
+// This works the same as in Timer.h: CONTROL_CLOCK_BITS is the CSxx clock divisor,
+//   CONTROL_CTC_MODE the WGMxx bits for CTC mode, and CONTROL_CLOCK_COUNT the OCRA
+//   count for one control tick.
+//
+// Some examples at 16 MHz, using timer 0:
+//
+//   Rate      Divisor   CLOCK_BITS      CLOCK_COUNT
+//    500 Hz   /256      CS2             125
+//   1000 Hz   /64       CS1 | CS0       250
+//   2000 Hz   /64       CS1 | CS0       125
+//
+// CONTROL_TICKS_PER_SEC must agree with the above.
+//
+#define CONTROL_TIMER_ID        0                   // use TIMER0
+#define CONTROL_CLOCK_BITS      _PIN_MASK(_CS1(CONTROL_TIMER_ID)) | \
+                                _PIN_MASK(_CS0(CONTROL_TIMER_ID))
+#define CONTROL_CTC_MODE        _PIN_MASK(_WGM1(CONTROL_TIMER_ID))
+#define CONTROL_CLOCK_COUNT     250
+#define CONTROL_TICKS_PER_SEC   1000
+
+//
+// The PWM and current measurements are accumulated over a "frame" of this many
+//   control ticks, then the power loop and resonance tracker run on the result.
+//
+// At 1 KHz, a 10 tick frame gives about 7 AtoD readings and 45 PWM cycles per frame.
+//
+#define CONTROL_FRAME_TICKS     10
+
+//
+// End of user configurable options
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data definitions and macros
+//
+#define CONTROL_FRAMES_PER_SEC  (CONTROL_TICKS_PER_SEC/CONTROL_FRAME_TICKS)
+
+#define DISABLE_CONTROL _CLR_BIT(_TIMSK(CONTROL_TIMER_ID),_OCIEA(CONTROL_TIMER_ID))
+#define ENABLE_CONTROL  _SET_BIT(_TIMSK(CONTROL_TIMER_ID),_OCIEA(CONTROL_TIMER_ID))
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlInit - Initialize and start the control tick
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void ControlInit(void);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlGetOverruns - Return number of control ticks dropped due to overrun
+//
+// Inputs:      None.
+//
+// Outputs:     Number of overruns since ControlInit()
+//
+uint16_t ControlGetOverruns(void);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ControlGetMaxCycles - Return longest control tick, in CPU cycles
+// ControlClearCycles  - Start the measurement over
+//
+// Inputs:      None.
+//
+// Outputs:     Longest tick since ControlInit() or ControlClearCycles()
+//
+// The time includes any interrupts taken during the tick, and a tick longer than
+//   65535 cycles (4 ms at 16 MHz) will wrap.
+//
+uint16_t ControlGetMaxCycles(void);
+void     ControlClearCycles(void);
+
+#endif  // CONTROL_H - entire file
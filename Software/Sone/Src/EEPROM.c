@@ -77,3 +77,21 @@ void EEPROMWrite(void) {
 
     eeprom_write_block(&EEPROM,0,sizeof(EEPROM));
     }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// EEPROMUpdate - Write part of the RAM copy back to EEPROM
+//
+// Inputs:      Address of first byte to write (within the EEPROM RAM copy)
+//              Number of bytes to write
+//
+// Outputs:     None.
+//
+// NOTE: Bytes that haven't changed are not rewritten
+//
+void EEPROMUpdate(void *Addr,uint16_t Size) {
+
+    eeprom_update_block(Addr,(void *) ((uint8_t *) Addr - (uint8_t *) &EEPROM),Size);
+    }
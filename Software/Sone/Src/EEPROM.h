@@ -62,6 +62,8 @@
 #include <stdint.h>
 
 #include "Setup.h"
+#include "Recipe.h"
+#include "ACS712.h"
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -81,10 +83,18 @@ typedef struct {
     // User defined vars go here
     //
     SETUP       Setups[MAX_SETUPS];
+    PWR_MAP     PwrMap;                 // Learned wiper vs power (see Transducer.h)
+    ACS712_CAL  Cal;                    // Current and supply calibration (see ACS712.h)
 
     //////////////////////////////////////////////////////////////////////////////////////
     } EEPROM_T;
 
+//
+// The recipes follow, in EEPROM only. They're too big to keep a RAM copy of, so are
+//   read and written a step at a time (see Recipe.c).
+//
+#define EEPROM_RECIPES      ((RECIPE *) sizeof(EEPROM_T))
+
 //
 // End of user configurable options
 //
@@ -117,4 +127,19 @@ void EEPROMInit(void);
 void EEPROMWrite(void);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// EEPROMUpdate - Write part of the RAM copy back to EEPROM
+//
+// Inputs:      Address of first byte to write (within the EEPROM RAM copy)
+//              Number of bytes to write
+//
+// Outputs:     None.
+//
+// NOTE: Bytes that haven't changed are not rewritten
+//
+void EEPROMUpdate(void *Addr,uint16_t Size);
+
+
 #endif  // EEPROM_H - entire file
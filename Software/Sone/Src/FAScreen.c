@@ -0,0 +1,169 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      FAScreen.c
+//
+//  DESCRIPTION
+//
+//      Fault screen
+//
+//      Show the state of each fault, and the fault history (see Fault.h)
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#include <avr/pgmspace.h>
+
+#include "FAScreen.h"
+#include "Fault.h"
+#include "Serial.h"
+#include "SerialLong.h"
+#include "Command.h"
+#include "VT100.h"
+
+#ifdef USE_FAULT_SCREEN
+
+//
+// Static layout of the fault screen
+//
+// The screen is short enough to redraw in full each update, and it all fits above
+//   the error and input rows.
+//
+static const prog_char FAScreenText[] = "\
+Count  Policy  State    Fault\r\n\
+-----  ------  -------  -----------------\r\n\
+";
+
+static const prog_char FALogText[] = "\
+    Time  Retry  Fault\r\n\
+";
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintTime - Print seconds since startup as H:MM:SS
+//
+// Inputs:      Seconds
+//
+// Outputs:     None.
+//
+static void PrintTime(TIME_T Secs) {
+
+    PrintLD(Secs/3600,2);
+    PrintChar(':');
+    PrintD((Secs/60)%60,102);
+    PrintChar(':');
+    PrintD(Secs%60,102);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ShowFAScreen - Display the fault screen
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void ShowFAScreen(void) {
+
+    CursorHome;
+    ClearScreen;
+
+    UpdateFAScreen();
+    }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// UpdateFAScreen - Display the fault screen
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void UpdateFAScreen(void) {
+    uint8_t Latched = FaultLatched();
+    uint8_t Pending = FaultPending();
+
+    CursorHome;
+    PrintStringP(FAScreenText);
+
+    //////////////////////////////////////////////////////////////////////////////////////
+    //
+    // One line per fault
+    //
+    for( uint8_t Index = 0; Index < NUM_FAULTS; Index++ ) {
+        FAULT   Fault = FAULT_OVERCURRENT + Index;
+        uint8_t Bit   = FAULT_BIT(Fault);
+
+        PrintD(FaultGetCount(Fault),5);
+        if( Bit & FAULT_LATCHING ) PrintStringP(PSTR("  Latch   "));
+        else                       PrintStringP(PSTR("  Retry   "));
+        if     ( Latched & Bit )   PrintStringP(PSTR("LATCHED  "));
+        else if( Pending & Bit )   PrintStringP(PSTR("Waiting  "));
+        else                       PrintStringP(PSTR("         "));
+        PrintFault(Fault);
+        ClearEOL;
+        PrintCRLF();
+        }
+
+    if( Pending ) {
+        PrintStringP(PSTR("Retry in "));
+        PrintD(FaultRetryIn(),0);
+        PrintStringP(PSTR(" secs"));
+        }
+    else if( Latched )
+        PrintStringP(PSTR("Latched, RE to reset"));
+    ClearEOL;
+    PrintCRLF();
+
+    //////////////////////////////////////////////////////////////////////////////////////
+    //
+    // Fault history, most recent first
+    //
+    PrintStringP(FALogText);
+
+    for( uint8_t Entry = 0; Entry < FAULT_HISTORY; Entry++ ) {
+        FAULT_LOG Log;
+
+        if( FaultGetLog(Entry,&Log) ) {
+            PrintTime(Log.Secs);
+            PrintD(Log.Retry,7);
+            PrintStringP(PSTR("  "));
+            PrintFault(Log.Fault);
+            }
+        ClearEOL;
+        PrintCRLF();
+        }
+
+    PlotInput();
+    }
+
+#endif // USE_FAULT_SCREEN
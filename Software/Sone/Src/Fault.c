@@ -0,0 +1,367 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Fault.c
+//
+//  DESCRIPTION
+//
+//      Fault manager
+//
+//      Latch or retry faults that stop the output, and keep a history of them.
+//
+//      See Fault.h for an in-depth description
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#include "PortMacros.h"
+#include "Fault.h"
+#include "Transducer.h"
+#include "Control.h"
+#include "Serial.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data declarations
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// The control tick changes everything here, so anything outside of it must disable
+//   the tick while looking.
+//
+static struct {
+    uint8_t     Latched;                            // Faults needing a reset
+    uint8_t     Pending;                            // Faults waiting on a retry
+    uint8_t     Retries;                            // Retries since a clean run
+    TIME_T      RetryAt;                            // When to retry, if Pending
+    TIME_T      Since;                              // Last fault or restart
+    TIME_T      Now;                                // Seconds, as of last FaultUpdate
+    uint8_t     Frames[NUM_FAULTS];                 // Frames each condition has lasted
+    uint16_t    Counts[NUM_FAULTS];                 // Times each fault has happened
+    FAULT_LOG   Log[FAULT_HISTORY];                 // Most recent faults
+    uint8_t     LogNext;                            // Next log entry to write
+    uint8_t     LogCount;                           // Entries in use
+    } Faults NOINIT;
+
+//
+// Per the WINAVR definition of PROGMEM, we must explicitly put each string into PROGMEM
+//   within an array separately
+//
+static char FT1[] PROGMEM = "Overcurrent";
+static char FT2[] PROGMEM = "Lost PWM";
+static char FT3[] PROGMEM = "Freq out of band";
+static char FT4[] PROGMEM = "Power unreachable";
+static char FT5[] PROGMEM = "Under voltage";
+static char FT6[] PROGMEM = "Over temperature";
+static char FT7[] PROGMEM = "EStop input";
+
+static char *FaultText[NUM_FAULTS] = {
+    FT1, FT2, FT3, FT4, FT5, FT6, FT7
+    };
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultInit - Initialize the fault manager
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void FaultInit(void) {
+
+    memset(&Faults,0,sizeof(Faults));
+
+    Faults.Now = TimerGetSeconds();
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Backoff - Schedule a retry, or latch if we've tried enough
+//
+// Inputs:      Faults which stopped the output
+//              Current time
+//
+// Outputs:     None.
+//
+static void Backoff(uint8_t Bits,TIME_T Now) {
+
+    if( Faults.Retries >= FAULT_MAX_RETRIES ) {
+        Faults.Latched |= Bits | Faults.Pending;
+        Faults.Pending  = 0;
+        return;
+        }
+
+    Faults.Pending |= Bits;
+    Faults.RetryAt  = Now + ((TIME_T) FAULT_RETRY_SECS << Faults.Retries);
+    Faults.Retries++;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultCheck - Check a fault condition, once per frame
+//
+// Inputs:      Fault to check
+//              TRUE if the fault condition is present this frame
+//              Frames the condition must last to be a fault
+//
+// Outputs:     TRUE  if the fault just happened, caller should stop the output
+//              FALSE otherwise
+//
+bool FaultCheck(FAULT Fault,bool Failed,uint8_t Frames) {
+    uint8_t *Count = &Faults.Frames[IDX_FAULT(Fault)];
+
+    if( !Failed ) {
+        *Count = 0;
+        return false;
+        }
+
+    if( ++*Count < Frames )
+        return false;
+
+    *Count = 0;
+    FaultRaise(Fault);
+    return true;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultRaise - Record a fault
+//
+// Inputs:      Fault that happened
+//
+// Outputs:     None.
+//
+void FaultRaise(FAULT Fault) {
+    uint8_t Bit = FAULT_BIT(Fault);
+    TIME_T  Now = Faults.Now;
+
+    Faults.Counts[IDX_FAULT(Fault)]++;
+
+    FAULT_LOG *Log = &Faults.Log[Faults.LogNext];
+
+    Log->Fault = Fault;
+    Log->Retry = Faults.Retries;
+    Log->Secs  = Now;
+
+    if( ++Faults.LogNext >= FAULT_HISTORY )
+        Faults.LogNext = 0;
+    if( Faults.LogCount < FAULT_HISTORY )
+        Faults.LogCount++;
+
+    Faults.Since = Now;
+
+    //
+    // Latching faults need a reset. The others only need a retry if they stopped
+    //   something.
+    //
+    if( Bit & FAULT_LATCHING )
+        Faults.Latched |= Bit;
+    else if( TransducerCurr.On )
+        Backoff(Bit,Now);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultUpdate - Retry the output, if a retry is due
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void FaultUpdate(void) {
+    TIME_T  Now = TimerGetSeconds();
+    uint8_t Pending;
+
+    DISABLE_CONTROL;
+
+    //
+    // The seconds count is kept by the main loop, so the control tick can't read it
+    //   safely. Pass it along for FaultRaise().
+    //
+    Faults.Now = Now;
+
+    //
+    // A clean run starts the backoff over
+    //
+    if( TransducerCurr.On && Faults.Retries && Now - Faults.Since >= FAULT_CLEAN_SECS )
+        Faults.Retries = 0;
+
+    Pending = Faults.Pending;
+    if( Pending && Now < Faults.RetryAt )
+        Pending = 0;
+
+    ENABLE_CONTROL;
+
+    if( !Pending )
+        return;
+
+    //
+    // Turning on cancels the retry. If the output won't come on (still under voltage,
+    //   for instance) that counts as another try.
+    //
+    TransducerRetry();
+
+    DISABLE_CONTROL;
+    if( TransducerCurr.On ) Faults.Since = Now;
+    else                    Backoff(Pending,Now);
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultReset       - Clear latched faults, pending retries, and the backoff
+// FaultCancelRetry - Forget any pending retry
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void FaultReset(void) {
+
+    Faults.Latched = 0;
+    Faults.Pending = 0;
+    Faults.Retries = 0;
+    memset(Faults.Frames,0,sizeof(Faults.Frames));
+    }
+
+
+void FaultCancelRetry(void) { Faults.Pending = 0; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultLatched - Return latched faults
+// FaultPending - Return faults waiting on a retry
+// FaultRetryIn - Return seconds until the next retry
+//
+// Inputs:      None.
+//
+// Outputs:     Bit mask of faults (see FAULT_BIT), or seconds
+//
+uint8_t FaultLatched(void) { return Faults.Latched; }
+uint8_t FaultPending(void) { return Faults.Pending; }
+
+uint16_t FaultRetryIn(void) {
+    TIME_T  Now = TimerGetSeconds();
+    TIME_T  RetryAt;
+
+    DISABLE_CONTROL;
+    RetryAt = Faults.RetryAt;
+    ENABLE_CONTROL;
+
+    if( !FaultPending() || RetryAt <= Now )
+        return 0;
+
+    return RetryAt - Now;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultGetCount - Return number of times a fault has happened
+// FaultGetLog   - Return a fault history entry
+// FaultClearLog - Clear the fault counts and history
+//
+// Inputs:      Fault to count
+//              Entry to get (0 == most recent), and where to put it
+//
+// Outputs:     Count
+//              TRUE  if the entry was returned
+//              FALSE if there aren't that many faults in the history
+//
+uint16_t FaultGetCount(FAULT Fault) {
+    uint16_t Rtnval;
+
+    DISABLE_CONTROL;
+    Rtnval = Faults.Counts[IDX_FAULT(Fault)];
+    ENABLE_CONTROL;
+
+    return Rtnval;
+    }
+
+
+bool FaultGetLog(uint8_t Entry,FAULT_LOG *Log) {
+    bool Rtnval = false;
+
+    DISABLE_CONTROL;
+    if( Entry < Faults.LogCount ) {
+        uint8_t Index = Faults.LogNext + FAULT_HISTORY - 1 - Entry;
+
+        if( Index >= FAULT_HISTORY )
+            Index -= FAULT_HISTORY;
+
+        *Log   = Faults.Log[Index];
+        Rtnval = true;
+        }
+    ENABLE_CONTROL;
+
+    return Rtnval;
+    }
+
+
+void FaultClearLog(void) {
+
+    DISABLE_CONTROL;
+    memset(Faults.Counts,0,sizeof(Faults.Counts));
+    Faults.LogNext  = 0;
+    Faults.LogCount = 0;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintFault - Print the name of a fault
+//
+// Inputs:      Fault to print
+//
+// Outputs:     None.
+//
+void PrintFault(FAULT Fault) {
+
+    PrintStringP(FaultText[IDX_FAULT(Fault)]);
+    }
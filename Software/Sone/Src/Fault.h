@@ -0,0 +1,262 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Fault.h
+//
+//  SYNOPSIS
+//
+//      //////////////////////////////////////
+//      //
+//      // In Main.c
+//      //
+//      FaultInit();                        // Before TransducerInit()
+//
+//      //////////////////////////////////////
+//      //
+//      // In the control tick
+//      //
+//      if( FaultCheck(FAULT_NO_PWM,Freq == 0,FAULT_PWM_FRAMES) )
+//          ...stop the output
+//
+//      FaultRaise(FAULT_OVERCURRENT);      // Immediate, no confirmation
+//
+//      //////////////////////////////////////
+//      //
+//      // In the UI tick
+//      //
+//      FaultUpdate();                      // Run any pending retry
+//
+//  DESCRIPTION
+//
+//      Fault manager
+//
+//      Collects the conditions that stop the output in one place. Each fault either
+//        latches, and the output stays off until reset (the RE command), or retries:
+//        the output is restarted after a delay which doubles with each consecutive
+//        fault, up to FAULT_MAX_RETRIES. After that the fault latches. A clean run of
+//        FAULT_CLEAN_SECS starts the backoff over.
+//
+//      Faults found by measurement have to persist for some number of frames before
+//        they count, so that a single odd frame doesn't stop the output.
+//
+//      The most recent faults are kept, with the time they happened, for the FA
+//        screen and the FL command.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Timer.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Faults
+//
+typedef enum {
+    FAULT_OVERCURRENT = 900,        // Overcurrent trip (see ACS712.h)
+    FAULT_NO_PWM,                   // Lost the PWM capture while running
+    FAULT_FREQ_BAND,                // Measured frequency out of band
+    FAULT_NO_POWER,                 // Power setpoint unreachable, PWM saturated
+    FAULT_UNDER_VOLT,               // Supply under voltage while running
+    FAULT_OVER_TEMP,                // Stack thermal model trip
+    FAULT_ESTOP,                    // EStop input
+    } FAULT;
+
+#define NUM_FAULTS      ( FAULT_ESTOP - FAULT_OVERCURRENT + 1 )
+#define IDX_FAULT(_x_)  (_x_ - FAULT_OVERCURRENT)       // Index of 1st fault
+#define FAULT_BIT(_x_)  (1 << IDX_FAULT(_x_))
+
+//
+// Faults which latch. The rest retry.
+//
+#define FAULT_LATCHING  (FAULT_BIT(FAULT_OVERCURRENT) | FAULT_BIT(FAULT_OVER_TEMP) | \
+                         FAULT_BIT(FAULT_ESTOP))
+
+//
+// Frames a condition has to last before it's a fault (at 100 frames per second)
+//
+#define FAULT_PWM_FRAMES    10      // No PWM capture
+#define FAULT_BAND_FRAMES   10      // Frequency out of band
+#define FAULT_POWER_FRAMES  200     // PWM saturated below the setpoint
+
+//
+// Retry backoff. The first retry is after FAULT_RETRY_SECS, then twice that, and so on.
+//
+#define FAULT_RETRY_SECS    1
+#define FAULT_MAX_RETRIES   6       // 1+2+4+8+16+32 secs, then latch
+#define FAULT_CLEAN_SECS    30      // Run this long without a fault to reset backoff
+
+#define FAULT_HISTORY       8       // Number of faults remembered
+
+//
+// End of user configurable options
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+//
+// Fault history entry
+//
+typedef struct {
+    FAULT       Fault;              // What happened
+    uint8_t     Retry;              // Retries before this one, since a clean run
+    TIME_T      Secs;               // When (see TimerGetSeconds)
+    } FAULT_LOG;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultInit - Initialize the fault manager
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void FaultInit(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultCheck - Check a fault condition, once per frame
+//
+// Inputs:      Fault to check
+//              TRUE if the fault condition is present this frame
+//              Frames the condition must last to be a fault
+//
+// Outputs:     TRUE  if the fault just happened, caller should stop the output
+//              FALSE otherwise
+//
+// NOTE: Called from the control tick
+//
+bool FaultCheck(FAULT Fault,bool Failed,uint8_t Frames);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultRaise - Record a fault
+//
+// Inputs:      Fault that happened
+//
+// Outputs:     None.
+//
+// Call before stopping the output, since a retry is only scheduled if the output was
+//   on at the time. The fault is timed as of the last FaultUpdate().
+//
+// NOTE: Called from the control tick, or with the control tick disabled
+//
+void FaultRaise(FAULT Fault);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultUpdate - Retry the output, if a retry is due
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Called by the transducer update, not for public consumption
+//
+void FaultUpdate(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultReset       - Clear latched faults, pending retries, and the backoff
+// FaultCancelRetry - Forget any pending retry
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// FaultCancelRetry() is used when the output is switched by hand, which overrides any
+//   retry.
+//
+// NOTE: Called with the control tick disabled
+//
+void FaultReset(void);
+void FaultCancelRetry(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultLatched - Return latched faults
+// FaultPending - Return faults waiting on a retry
+// FaultRetryIn - Return seconds until the next retry
+//
+// Inputs:      None.
+//
+// Outputs:     Bit mask of faults (see FAULT_BIT), or seconds
+//
+uint8_t  FaultLatched(void);
+uint8_t  FaultPending(void);
+uint16_t FaultRetryIn(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// FaultGetCount - Return number of times a fault has happened
+// FaultGetLog   - Return a fault history entry
+// FaultClearLog - Clear the fault counts and history
+//
+// Inputs:      Fault to count
+//              Entry to get (0 == most recent), and where to put it
+//
+// Outputs:     Count
+//              TRUE  if the entry was returned
+//              FALSE if there aren't that many faults in the history
+//
+uint16_t FaultGetCount(FAULT Fault);
+bool     FaultGetLog(uint8_t Entry,FAULT_LOG *Log);
+void     FaultClearLog(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintFault - Print the name of a fault
+//
+// Inputs:      Fault to print
+//
+// Outputs:     None.
+//
+void PrintFault(FAULT Fault);
+
+#endif  // FAULT_H - entire file
@@ -41,6 +41,9 @@
 
 #include "Transducer.h"
 #include "Setup.h"
+#include "Recipe.h"
+#include "Control.h"
+#include "Fault.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +51,7 @@
 #include "Command.h"
 #include "Parse.h"
 #include "Serial.h"
+#include "SerialLong.h"
 #include "VT100.h"
 
 #include "Debug.h"
@@ -64,6 +68,10 @@ static bool PromptNeeded;           // TRUE if need to replot the prompt
 
 static TRANSDUCER_SET   PrevSet;    // Previous shown values
 static TRANSDUCER_CURR  PrevCurr;
+static uint16_t         PrevOverruns;
+static uint8_t          PrevFaults;
+static uint32_t         PrevEnergy;
+static uint32_t         PrevLeft;
 
 //
 // Static layout of the main screen
@@ -72,13 +80,16 @@ static char MAScreenText[] PROGMEM = "\
 EStop :  ---- |  Out:   ---\r\n\
 Freq  : ----- | Freq: -----\r\n\
 Pwr   :  ---- |  Pwr:  ----\r\n\
-Ctrl  :    -- |\r\n\
-Run   : ----- |\r\n\
-RunTim:   --- |\r\n\
+Ctrl  :    -- | Lock:   ---\r\n\
+Run   : ----- | Ovrn: -----\r\n\
+RunTim:   --- | Puls: -----\r\n\
 ==============+============\r\n\
-Amps  :  ---- \r\n\
-PWM   :  ----\r\n\
-PWip  :   ---\r\n\
+Amps  :  ---- | Enrg: -------\r\n\
+PWM   :  ---- | Left: -------\r\n\
+PWip  :   --- | Load:  ----\r\n\
+Volts : ----- | Supp:  ----\r\n\
+Limit :   --- | Rtun: -----\r\n\
+Heat  :  ---% | Pmax:  ---%\r\n\
 \r\n\
 ";
 
@@ -92,16 +103,28 @@ PWip  :   ---\r\n\
 #define POS_PWRM    CursorPos(23,3)
 
 #define POS_CMODE   CursorPos(12,4)
+#define POS_LOCK    CursorPos(25,4)
 #define POS_RMODE   CursorPos(9,5)
+#define POS_OVRN    CursorPos(23,5)
 #define POS_RTIME   CursorPos(9,6)
+#define POS_PULSES  CursorPos(23,6)
 
 #define POS_AMPS    CursorPos(9,8)
 #define POS_PWM     CursorPos(9,9)
+#define POS_ENRG    CursorPos(23,8)
+#define POS_LEFT    CursorPos(23,9)
 #define POS_PWW     CursorPos(11,10)
+#define POS_LOAD    CursorPos(24,10)
+#define POS_VOLTS   CursorPos(9,11)
+#define POS_SUPPLY  CursorPos(24,11)
+#define POS_LIMIT   CursorPos(11,12)
+#define POS_RETUNE  CursorPos(23,12)
+#define POS_HEAT    CursorPos(10,13)
+#define POS_PMAX    CursorPos(24,13)
 
-#define POS_MSG     CursorPos(1,14)
+#define POS_MSG     CursorPos(1,15)
 
-#define DEBUG_ROW   14
+#define DEBUG_ROW   15
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -143,6 +166,9 @@ void ShowMAScreen(void) {
     //
     Unset(&PrevSet ,&TransducerSet ,sizeof(PrevSet));
     Unset(&PrevCurr,&TransducerCurr,sizeof(PrevCurr));
+    PrevOverruns = ~ControlGetOverruns();
+    PrevEnergy   = ~TransducerGetEnergy();
+    PrevLeft     = 0xFFFFFFFF;         // Never a real dose
 
     UpdateMAScreen();
     }
@@ -179,11 +205,20 @@ void UpdateMAScreen(void) {
     //
     // Screen-specific display fields
     //
-    if( PrevCurr.EStop != TransducerCurr.EStop ) {
-        PrevCurr.EStop  = TransducerCurr.EStop;
+    uint8_t Faults = FaultLatched() | FaultPending();
+
+    if( PrevCurr.EStop   != TransducerCurr.EStop   ||
+        PrevCurr.Tripped != TransducerCurr.Tripped ||
+        PrevFaults       != Faults ) {
+        PrevCurr.EStop   = TransducerCurr.EStop;
+        PrevCurr.Tripped = TransducerCurr.Tripped;
+        PrevFaults       = Faults;
         POS_ESTOP;
-        if( PrevCurr.EStop ) PrintStringP(PSTR("Stop"));
-        else                 PrintStringP(PSTR(" Run"));
+        if     ( PrevCurr.Tripped ) PrintStringP(PSTR("Trip"));
+        else if( PrevCurr.EStop   ) PrintStringP(PSTR("Stop"));
+        else if( FaultLatched()   ) PrintStringP(PSTR("Falt"));
+        else if( FaultPending()   ) PrintStringP(PSTR("Wait"));
+        else                        PrintStringP(PSTR(" Run"));
         }
 
     if( PrevCurr.On != TransducerCurr.On ) {
@@ -222,6 +257,18 @@ void UpdateMAScreen(void) {
         POS_CMODE;
         if( PrevSet.CtlMode == CTL_CONST_FREQ ) PrintStringP(PSTR("CF"));
         if( PrevSet.CtlMode == CTL_MAX_EFF    ) PrintStringP(PSTR("ME"));
+        if( PrevSet.CtlMode == CTL_FREQ_MOD   ) PrintStringP(PSTR("FM"));
+        if( PrevSet.CtlMode == CTL_CONST_CURRENT ) PrintStringP(PSTR("CC"));
+        }
+
+    if( PrevCurr.Locked    != TransducerCurr.Locked ||
+        PrevCurr.Acquiring != TransducerCurr.Acquiring ) {
+        PrevCurr.Locked    = TransducerCurr.Locked;
+        PrevCurr.Acquiring = TransducerCurr.Acquiring;
+        POS_LOCK;
+        if     ( PrevCurr.Acquiring ) PrintStringP(PSTR("Acq"));
+        else if( PrevCurr.Locked    ) PrintStringP(PSTR("Yes"));
+        else                          PrintStringP(PSTR(" No"));
         }
 
     if( PrevSet.RunMode != TransducerSet.RunMode ) {
@@ -229,6 +276,14 @@ void UpdateMAScreen(void) {
         POS_RMODE;
         if( PrevSet.RunMode == RUN_CONTINUOUS ) PrintStringP(PSTR("Contn"));
         if( PrevSet.RunMode == RUN_TIMED      ) PrintStringP(PSTR("Timed"));
+        if( PrevSet.RunMode == RUN_PULSED     ) PrintStringP(PSTR("Pulse"));
+        if( PrevSet.RunMode == RUN_ENERGY     ) PrintStringP(PSTR("Enrgy"));
+        }
+
+    if( PrevOverruns != ControlGetOverruns() ) {
+        PrevOverruns  = ControlGetOverruns();
+        POS_OVRN;
+        PrintD(PrevOverruns,5);
         }
 
     if( PrevSet.RunTimer != TransducerSet.RunTimer ) {
@@ -237,6 +292,33 @@ void UpdateMAScreen(void) {
         PrintD(PrevSet.RunTimer,5);
         }
 
+    if( PrevCurr.Pulses != TransducerCurr.Pulses ) {
+        PrevCurr.Pulses  = TransducerCurr.Pulses;
+        POS_PULSES;
+        PrintD(PrevCurr.Pulses,5);
+        }
+
+    //
+    // Energy delivered, and what's left of the dose when running one
+    //
+    uint32_t Energy = TransducerGetEnergy();
+    uint32_t Left   = 0;
+
+    if( TransducerSet.RunMode == RUN_ENERGY && Energy < TransducerSet.Energy )
+        Left = TransducerSet.Energy - Energy;
+
+    if( PrevEnergy != Energy ) {
+        PrevEnergy  = Energy;
+        POS_ENRG;
+        PrintLD(PrevEnergy,7);
+        }
+
+    if( PrevLeft != Left ) {
+        PrevLeft  = Left;
+        POS_LEFT;
+        PrintLD(PrevLeft,7);
+        }
+
     if( PrevCurr.Current != TransducerCurr.Current ) {
         PrevCurr.Current  = TransducerCurr.Current;
         POS_AMPS;
@@ -249,6 +331,58 @@ void UpdateMAScreen(void) {
         PrintX10(PrevCurr.PWM);
         }
 
+    if( PrevCurr.Load    != TransducerCurr.Load ||
+        PrevCurr.LoadCal != TransducerCurr.LoadCal ) {
+        PrevCurr.Load    = TransducerCurr.Load;
+        PrevCurr.LoadCal = TransducerCurr.LoadCal;
+        POS_LOAD;
+        if     ( PrevCurr.LoadCal           ) PrintStringP(PSTR(" Cal"));
+        else if( PrevCurr.Load == LOAD_DRY  ) PrintStringP(PSTR(" Dry"));
+        else if( PrevCurr.Load == LOAD_OK   ) PrintStringP(PSTR("  OK"));
+        else if( PrevCurr.Load == LOAD_OVER ) PrintStringP(PSTR("Over"));
+        else                                  PrintStringP(PSTR(" ---"));
+        }
+
+    if( PrevCurr.Volts != TransducerCurr.Volts ) {
+        PrevCurr.Volts  = TransducerCurr.Volts;
+        POS_VOLTS;
+        PrintD(PrevCurr.Volts/100,2);
+        PrintChar('.');
+        PrintD(PrevCurr.Volts%100,102);
+        }
+
+    if( PrevCurr.UnderVolt != TransducerCurr.UnderVolt ) {
+        PrevCurr.UnderVolt  = TransducerCurr.UnderVolt;
+        POS_SUPPLY;
+        if( PrevCurr.UnderVolt ) PrintStringP(PSTR(" Low"));
+        else                     PrintStringP(PSTR("  OK"));
+        }
+
+    if( PrevCurr.PowerLimited != TransducerCurr.PowerLimited ) {
+        PrevCurr.PowerLimited  = TransducerCurr.PowerLimited;
+        POS_LIMIT;
+        if( PrevCurr.PowerLimited ) PrintStringP(PSTR("Yes"));
+        else                        PrintStringP(PSTR(" No"));
+        }
+
+    if( PrevCurr.Retune != TransducerCurr.Retune ) {
+        PrevCurr.Retune  = TransducerCurr.Retune;
+        POS_RETUNE;
+        PrintSD(PrevCurr.Retune,4);
+        }
+
+    if( PrevCurr.Heat != TransducerCurr.Heat ) {
+        PrevCurr.Heat  = TransducerCurr.Heat;
+        POS_HEAT;
+        PrintD(PrevCurr.Heat,3);
+        }
+
+    if( PrevCurr.HeatScale != TransducerCurr.HeatScale ) {
+        PrevCurr.HeatScale  = TransducerCurr.HeatScale;
+        POS_PMAX;
+        PrintD((PrevCurr.HeatScale*100U + 128) >> 8,3);
+        }
+
     if( PrevCurr.PWMWiper != TransducerCurr.PWMWiper ) {
         PrevCurr.PWMWiper  = TransducerCurr.PWMWiper;
         POS_PWW;
@@ -297,6 +431,9 @@ bool MAScreenCommand(char *Command) {
     if( TransducerCmd(Command) )
         return true;
 
+    if( RecipeCmd(Command) )
+        return true;
+
     //
     // CL - Clear the message area
     //
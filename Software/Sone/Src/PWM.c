@@ -46,6 +46,7 @@
 
 #include <PWM.h>
 #include <TimerMacros.h>
+#include <Control.h>
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -55,18 +56,55 @@
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 
+//
+// Totals for the window being measured. The ISR adds to these, and PWMUpdate() takes
+//   them and starts a new window.
+//
+typedef struct {
+    uint32_t    FreqTotal;                          // Total ticks in counted cycles
+    uint32_t    LowTotal;                           // Total low time ticks sampled
+    uint32_t    JitterTotal;                        // Total cycle to cycle change
+    uint16_t    FreqCycles;                         // Number of cycles in FreqTotal
+    uint16_t    LowCount;                           // Number of samples in LowTotal
+    uint16_t    JitterCount;                        // Number of changes in JitterTotal
+    uint16_t    MinPeriod;                          // Shortest cycle
+    uint16_t    MaxPeriod;                          // Longest  cycle
+    uint16_t    MinLow;                             // Shortest low time
+    uint16_t    MaxLow;                             // Longest  low time
+    uint16_t    Lost;                               // Cycles left out
+    } PWM_WINDOW;
+
 static struct {
     uint16_t    CaptLow;                            // Timer at low  transition
     uint16_t    CaptHigh;                           // Timer at high transition
-    uint16_t    FreqTotal;                          // Total     ticks in counted cycles
-    uint16_t    FreqCycles;                         // Number of cycles in totals
-    uint16_t    PWMTotal;                           // Total PWM ticks in counted cycles
+    uint16_t    PrevPeriod;                         // Previous cycle (0 == none yet)
+    PWM_WINDOW  Window;                             // Window being measured
+    PWM_STATS   Stats;                              // Stats from the last window
+    uint32_t    GateTicks;                          // Gate time (CPU cycles)
+    uint32_t    GateTotal;                          // Total ticks in gate so far
+    uint32_t    GateCycles;                         // Number of cycles in GateTotal
+    uint32_t    GateEndTotal;                       // Ticks  in the last closed gate
+    uint32_t    GateEndCycles;                      // Cycles in the last closed gate
     uint16_t    PWM;                                // Calculated PWM  value
     uint16_t    Freq;                               // Calculated Freq value
-    int8_t      SkipCount;                          // Cycles until next measurement
-    bool        FreqEnd;                            // TRUE if next meas is end of FREQ
+    int8_t      DutyCount;                          // Cycles until next duty sample
+    bool        DutyEnd;                            // TRUE if next rising ends a low
+    bool        Valid;                              // TRUE if CaptHigh is an edge
     } PWM NOINIT;
 
+#ifdef USE_PWM_CAPTURE
+static struct {
+    PWM_CAPT        Buffer[PWM_CAPT_SIZE];          // Raw cycles
+    uint8_t         Next;                           // Where the next entry goes
+    uint8_t         Count;                          // Entries in buffer
+    uint8_t         Post;                           // Entries left after trigger
+    PWM_TRIG        Trigger;                        // What to trigger on
+    PWM_CAPT_STATE  State;                          // Where we are
+    } Ring NOINIT;
+
+#define RECORDING   (Ring.State == CAPT_ARMED || Ring.State == CAPT_TRIGGERED)
+#endif
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //
 // Setup some port designations
@@ -80,8 +118,10 @@ static struct {
 #define TCCRAx          _TCCRA(PWM_TIMER_ID)
 #define TCCRBx          _TCCRB(PWM_TIMER_ID)
 #define TIMSKx          _TIMSK(PWM_TIMER_ID)
+#define TIFRx           _TIFR(PWM_TIMER_ID)
 #define TCNTx           _TCNT(PWM_TIMER_ID)
 #define ICIEx           _ICIE(PWM_TIMER_ID)
+#define ICFx            _ICF(PWM_TIMER_ID)
 #define ICRx            _ICR(PWM_TIMER_ID)
 
 #define PWM_FILTER      _PIN_MASK(_ICNC(PWM_TIMER_ID))
@@ -92,7 +132,31 @@ static struct {
 #define DISABLE_INT     _CLR_BIT(TIMSKx,ICIEx)
 #define ENABLE_INT      _SET_BIT(TIMSKx,ICIEx)
 
-#define SKIP_MAX        10
+//
+// Changing the edge can set the capture flag, so clear it after
+//
+#define EDGE_RISING     { _SET_BIT(TCCRBx,RISING_EDGE); TIFRx = _PIN_MASK(ICFx); }
+#define EDGE_FALLING    { _CLR_BIT(TCCRBx,RISING_EDGE); TIFRx = _PIN_MASK(ICFx); }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// StartWindow - Clear the totals for a new window
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Called with the capture interrupt disabled
+//
+static void StartWindow(void) {
+
+    memset(&PWM.Window,0,sizeof(PWM.Window));
+
+    PWM.Window.MinPeriod = 0xFFFF;
+    PWM.Window.MinLow    = 0xFFFF;
+    }
+
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -106,8 +170,14 @@ static struct {
 void PWMInit(void) {
 
     memset(&PWM,0,sizeof(PWM));
+#ifdef USE_PWM_CAPTURE
+    memset(&Ring,0,sizeof(Ring));
+    Ring.State = CAPT_IDLE;
+#endif
 
-    PWM.SkipCount = SKIP_MAX;
+    StartWindow();
+    PWM.DutyCount = PWM_DUTY_EVERY;
+    PWM.GateTicks = (uint32_t) PWM_DEF_GATE_MS*(F_CPU/1000);
 
     _CLR_BIT(PRR,PRTIMx);           // Powerup the clock
 
@@ -118,6 +188,7 @@ void PWMInit(void) {
     TCCRBx = PWM_MODE;
     TCNTx  = 0;
 
+    EDGE_RISING;
     ENABLE_INT;
     }
 
@@ -131,33 +202,78 @@ void PWMInit(void) {
 // Outputs:     None.
 //
 void PWMUpdate(void) {
-    uint16_t    FreqLocal;
-    uint16_t    PWMLocal;
-    uint16_t    CyclesLocal;
+    PWM_WINDOW  Window;
 
     DISABLE_INT;
 
-    FreqLocal   = PWM.FreqTotal;
-    PWMLocal    = PWM.PWMTotal;
-    CyclesLocal = PWM.FreqCycles;
+    Window = PWM.Window;
+    StartWindow();
 
-    PWM.FreqTotal  = 0;
-    PWM.PWMTotal   = 0;
-    PWM.FreqCycles = 0;
+    //
+    // No edges for a whole window means the output is off. The timer will have
+    //   wrapped by the time it comes back, so start the cycle chain over.
+    //
+    if( Window.FreqCycles == 0 && Window.LowCount == 0 ) {
+        PWM.Valid      = false;
+        PWM.DutyEnd    = false;
+        PWM.PrevPeriod = 0;
+        PWM.GateTotal  = 0;
+        PWM.GateCycles = 0;
+        PWM.GateEndCycles = 0;
+        EDGE_RISING;
+        }
 
     ENABLE_INT;
 
+    memset(&PWM.Stats,0,sizeof(PWM.Stats));
+    PWM.Stats.Lost = Window.Lost;
+
     //
     // If system is off, no frequency or PWM will be seen from last update
     //
-    if( FreqLocal == 0 ) {
+    if( Window.FreqCycles == 0 ) {
         PWM.PWM  = 0;
         PWM.Freq = 0;
+        return;
         }
-    else {
-        PWM.PWM  = ((uint32_t) PWMLocal*1000)/((uint32_t) FreqLocal);
-        PWM.Freq = ((uint32_t) F_CPU*CyclesLocal)/((uint32_t) FreqLocal);
+
+    //
+    // Work with the average period in 1/256 ticks. The window is well under 2^24 ticks
+    //   (one second), so this fits, and F_CPU << 8 still fits in 32 bits.
+    //
+    uint32_t    Period = ((Window.FreqTotal << 8) + Window.FreqCycles/2)/Window.FreqCycles;
+
+    PWM.Freq = ((uint32_t) F_CPU << 8)/Period;
+
+    PWM.Stats.Cycles    = Window.FreqCycles;
+    PWM.Stats.MinPeriod = Window.MinPeriod;
+    PWM.Stats.MaxPeriod = Window.MaxPeriod;
+
+    if( Window.JitterCount )
+        PWM.Stats.Jitter = ((Window.JitterTotal*1000)/(F_CPU/1000000))/Window.JitterCount;
+
+    //
+    // PWM is the high time, which is what's left of the period after the low time.
+    //   Keep the last PWM if no duty sample landed in this window.
+    //
+    if( Window.LowCount ) {
+        uint32_t    Low   = (Window.LowTotal << 8)/Window.LowCount;
+        uint32_t    Scale = Period >> 3;
+
+        if( Low > Period ) Low = Period;
+
+        PWM.PWM = 1000 - (Low*125)/Scale;
+
+        uint32_t    MaxLow = (uint32_t) Window.MaxLow << 8;
+        uint32_t    MinLow = (uint32_t) Window.MinLow << 8;
+
+        if( MaxLow > Period ) MaxLow = Period;
+        if( MinLow > Period ) MinLow = Period;
+
+        PWM.Stats.MinPWM = 1000 - (MaxLow*125)/Scale;
+        PWM.Stats.MaxPWM = 1000 - (MinLow*125)/Scale;
         }
+    else PWM.Stats.MinPWM = PWM.Stats.MaxPWM = PWM.PWM;
     }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -184,6 +300,235 @@ uint16_t GetPWM(void) { return PWM.PWM; }
 uint16_t GetPWMFreq(void) { return PWM.Freq; }
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGetStats - Return statistics for the last window
+//
+// Inputs:      Where to put the statistics
+//
+// Outputs:     None.
+//
+void PWMGetStats(PWM_STATS *Stats) { *Stats = PWM.Stats; }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGate - Set gate time for the gated frequency
+//
+// Inputs:      Gate time (ms)
+//
+// Outputs:     None.
+//
+void PWMGate(uint16_t GateMS) {
+
+    if( GateMS < PWM_GATE_MIN_MS ) GateMS = PWM_GATE_MIN_MS;
+    if( GateMS > PWM_GATE_MAX_MS ) GateMS = PWM_GATE_MAX_MS;
+
+    DISABLE_INT;
+    PWM.GateTicks  = (uint32_t) GateMS*(F_CPU/1000);
+    PWM.GateTotal  = 0;
+    PWM.GateCycles = 0;
+    ENABLE_INT;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGetGateFreq - Return frequency from the last gate
+//
+// Inputs:      None.
+//
+// Outputs:     Measured frequency, in Hz x 65536
+//
+// Reciprocal count: cycles over the time they took. With a 1 sec gate the top needs
+//   about 50 bits, so this is the one place we go to 64. That's thousands of cycles,
+//   so it's done here in the main loop rather than in the control tick.
+//
+uint32_t PWMGetGateFreq(void) {
+    uint32_t    GateTotal;
+    uint32_t    GateCycles;
+
+    DISABLE_CONTROL;
+    DISABLE_INT;
+    GateTotal  = PWM.GateEndTotal;
+    GateCycles = PWM.GateEndCycles;
+    ENABLE_INT;
+    ENABLE_CONTROL;
+
+    if( GateCycles == 0 || GateTotal == 0 )
+        return 0;
+
+    return ((((uint64_t) F_CPU*GateCycles) << 16) + GateTotal/2)/GateTotal;
+    }
+
+
+#ifdef USE_PWM_CAPTURE
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptArm - Clear the capture ring and start recording
+//
+// Inputs:      What to trigger on
+//
+// Outputs:     None.
+//
+void PWMCaptArm(PWM_TRIG Trigger) {
+
+    DISABLE_INT;
+    Ring.Next    = 0;
+    Ring.Count   = 0;
+    Ring.Trigger = Trigger;
+    Ring.State   = CAPT_ARMED;
+    ENABLE_INT;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// CaptTrigger - Start the post trigger part of the recording
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Called from the ISR, or with the capture interrupt disabled
+//
+static inline void CaptTrigger(void) {
+
+    if( Ring.State != CAPT_ARMED )
+        return;
+
+    Ring.State = CAPT_TRIGGERED;
+    Ring.Post  = PWM_CAPT_POST;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptTrigger - Trigger the capture by hand
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void PWMCaptTrigger(void) {
+
+    DISABLE_INT;
+    CaptTrigger();
+    ENABLE_INT;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptState - Return state of capture
+// PWMCaptCount - Return number of entries recorded
+// PWMCaptTrig  - Return index of the first entry after the trigger
+//
+// Inputs:      None.
+//
+// Outputs:     As above
+//
+PWM_CAPT_STATE PWMCaptState(void) { return Ring.State; }
+uint8_t        PWMCaptCount(void) { return Ring.Count; }
+
+uint8_t PWMCaptTrig(void) {
+
+    if( Ring.State != CAPT_FROZEN )
+        return 0;
+
+    return Ring.Count > PWM_CAPT_POST ? Ring.Count - PWM_CAPT_POST : 0;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptGet - Return one entry from a frozen capture
+//
+// Inputs:      Index of entry, 0 is oldest
+//              Where to put the entry
+//
+// Outputs:     TRUE  if entry returned
+//              FALSE if not frozen, or past the end
+//
+// Once frozen the ISR leaves the ring alone, so no need to lock it out
+//
+bool PWMCaptGet(uint8_t Index,PWM_CAPT *Entry) {
+
+    if( Ring.State != CAPT_FROZEN || Index >= Ring.Count )
+        return false;
+
+    *Entry = Ring.Buffer[(Ring.Next - Ring.Count + Index) & (PWM_CAPT_SIZE-1)];
+    return true;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// CaptRecord - Record one entry into the capture ring
+//
+// Inputs:      Period    (CPU clocks)
+//              High time (CPU clocks)
+//
+// Outputs:     None.
+//
+// NOTE: Called from the ISR
+//
+static inline void CaptRecord(uint16_t Period,uint16_t High) {
+
+    Ring.Buffer[Ring.Next].Period = Period;
+    Ring.Buffer[Ring.Next].High   = High;
+    Ring.Next = (Ring.Next + 1) & (PWM_CAPT_SIZE-1);
+
+    if( Ring.Count < PWM_CAPT_SIZE )
+        Ring.Count++;
+
+    if( Ring.State == CAPT_TRIGGERED && --Ring.Post == 0 )
+        Ring.State = CAPT_FROZEN;
+    }
+#endif // USE_PWM_CAPTURE
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// AddCycles - Count cycles into the window and the gate
+//
+// Inputs:      Ticks the cycles took
+//              Number of cycles
+//
+// Outputs:     None.
+//
+// The gate closes once it has run for the gate time, always on an edge
+//
+// NOTE: Called from the ISR
+//
+static inline void AddCycles(uint16_t Span,uint8_t Cycles) {
+
+    PWM.Window.FreqTotal  += Span;
+    PWM.Window.FreqCycles += Cycles;
+
+    PWM.GateTotal  += Span;
+    PWM.GateCycles += Cycles;
+
+    if( PWM.GateTotal < PWM.GateTicks )
+        return;
+
+    PWM.GateEndTotal  = PWM.GateTotal;
+    PWM.GateEndCycles = PWM.GateCycles;
+    PWM.GateTotal     = 0;
+    PWM.GateCycles    = 0;
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -193,52 +538,115 @@ uint16_t GetPWMFreq(void) { return PWM.Freq; }
 //
 // Outputs:     None.
 //
-ISR(TIMER1_CAPT_vect,ISR_NOBLOCK) {
-
-    //////////////////////////////////////////////////////////////////////////////////////
-    //
-    // Save CPU time by only measuring 1-in-10 cycles
-    //
-    if( --PWM.SkipCount > 0 )
-        return;
+// NOTE: This runs every cycle, so it's kept short and doesn't let other interrupts in.
+//         The control tick in particular runs for a long time, and the next edge
+//         would come in on top of a half finished update.
+//
+ISR(TIMER1_CAPT_vect) {
+    uint16_t    Capt = ICRx;
 
     //////////////////////////////////////////////////////////////////////////////////////
     //
     // FALLING EDGE
     //
-    // Note the ICP of the falling edge. Set next round to interrupt on rising edge.
+    // Note the start of the low time, and go back to rising edges to end it.
     //
     if( _BIT_OFF(TCCRBx,RISING_EDGE) ) {
-        PWM.CaptLow = ICRx;
-        PWM.FreqEnd = false;
-        _SET_BIT(TCCRBx,RISING_EDGE);
+        PWM.CaptLow = Capt;
+        PWM.DutyEnd = true;
+        EDGE_RISING;
+        return;
+        }
+
+    uint16_t    Span = Capt - PWM.CaptHigh;
+    uint16_t    Prev = PWM.PrevPeriod;
+
+    PWM.CaptHigh = Capt;
+
+    if( !PWM.Valid ) {
+        PWM.Valid = true;
+#ifdef USE_PWM_CAPTURE
+        if( Ring.Trigger == TRIG_START )
+            CaptTrigger();
+        if( RECORDING )
+            EDGE_FALLING;
+#endif
         return;
         }
 
     //////////////////////////////////////////////////////////////////////////////////////
     //
-    // 1ST RISING EDGE
+    // RISING EDGE AFTER A LOW TIME
     //
-    // Note the ICP of the rising edge. Set next round to interrupt on rising edge.
+    // If the high time was too short to catch the falling edge in the same cycle, we
+    //   caught the next one and the span is two cycles.
     //
-    if( !PWM.FreqEnd ) {
-        PWM.CaptHigh = ICRx;
-        PWM.FreqEnd  = true;
+    if( PWM.DutyEnd ) {
+        uint16_t    Low = Capt - PWM.CaptLow;
+
+        PWM.DutyEnd = false;
+
+        PWM.Window.LowTotal += Low;
+        PWM.Window.LowCount++;
+        if( Low < PWM.Window.MinLow ) PWM.Window.MinLow = Low;
+        if( Low > PWM.Window.MaxLow ) PWM.Window.MaxLow = Low;
+
+        uint8_t     Cycles = (Prev && Span > Prev + (Prev >> 1)) ? 2 : 1;
+
+        AddCycles(Span,Cycles);
+
+        if( Cycles == 1 )
+            PWM.PrevPeriod = Span;
+
+#ifdef USE_PWM_CAPTURE
+        //
+        // While recording, go straight back for the next falling edge
+        //
+        if( RECORDING ) {
+            if( Cycles > 1 && Ring.Trigger == TRIG_LOST )
+                CaptTrigger();
+            CaptRecord(Span,Span - Low);
+            if( RECORDING )
+                EDGE_FALLING;
+            }
+#endif
         return;
         }
 
     //////////////////////////////////////////////////////////////////////////////////////
     //
-    // 2ND RISING EDGE
+    // RISING EDGE
     //
-    // Total the PWM and FREQ counts
+    // One cycle, unless it's out of line with the one before.
     //
-    uint16_t    FreqCount = ICRx - PWM.CaptHigh;
+    PWM.PrevPeriod = Span;
+
+    if( Prev && (Span > Prev + (Prev >> 1) || Span < (Prev >> 1)) ) {
+        PWM.Window.Lost++;
+#ifdef USE_PWM_CAPTURE
+        if( Ring.Trigger == TRIG_LOST )
+            CaptTrigger();
+#endif
+        return;
+        }
+
+    AddCycles(Span,1);
+    if( Span < PWM.Window.MinPeriod ) PWM.Window.MinPeriod = Span;
+    if( Span > PWM.Window.MaxPeriod ) PWM.Window.MaxPeriod = Span;
+
+    if( Prev ) {
+        PWM.Window.JitterTotal += Span > Prev ? Span - Prev : Prev - Span;
+        PWM.Window.JitterCount++;
+        }
+
+#ifdef USE_PWM_CAPTURE
+    if( RECORDING )
+        PWM.DutyCount = 1;
+#endif
 
-    PWM.FreqTotal += FreqCount;
-    PWM.PWMTotal  += FreqCount - (PWM.CaptHigh - PWM.CaptLow);
-    PWM.FreqCycles++;
-    PWM.SkipCount = SKIP_MAX;
+    if( --PWM.DutyCount > 0 )
+        return;
 
-    _CLR_BIT(TCCRBx,RISING_EDGE);
+    PWM.DutyCount = PWM_DUTY_EVERY;
+    EDGE_FALLING;
     }
@@ -44,6 +44,44 @@
 //
 //      PWM processing
 //
+//      Every rising edge is captured, so the frequency is measured over every cycle
+//        of the window between calls to PWMUpdate(), with no gaps between windows.
+//        The totals are 32 bits, so a window can be up to a second long.
+//
+//      The duty needs the falling edge as well, but the high time can be too short to
+//        switch edges in. Instead, every PWM_DUTY_EVERY cycles the capture switches to
+//        the falling edge and measures the low time that follows. The rising edge
+//        that ends it still counts toward the frequency.
+//
+//      A cycle much longer or shorter than the one before means an edge was missed
+//        (interrupts held off too long) or the timer wrapped while the output was off.
+//        Those are counted as lost and left out.
+//
+//      Along with the averages, each window records the shortest and longest cycle,
+//        the range of duty seen, and the mean change in period from one cycle to the
+//        next as a jitter figure (see PWMGetStats).
+//
+//      Separately, the same cycles are counted over a gate of selectable length
+//        (see PWMGate). The gate closes on the first edge after the gate time, so it
+//        always holds a whole number of cycles, and the frequency is that count over
+//        the exact time they took. Resolution is one CPU clock over the gate time: a
+//        1 sec gate resolves about 0.002 Hz at 30 KHz, a 10 ms gate about 0.2 Hz.
+//
+//      The ISR keeps the count and time of the last gate to close, and the frequency
+//        is worked out from them when asked for (see PWMGetGateFreq). Gates are no
+//        shorter than one control frame.
+//
+//      For tuning, the raw cycles can be recorded into a ring buffer (see PWMCaptArm).
+//        While recording, the duty is sampled on every cycle, and each entry is the
+//        period and high time of one cycle in CPU clocks. When the high time is too
+//        short to switch edges in, the entry spans two cycles and the high time
+//        includes the first of them, which is easy to spot afterwards.
+//
+//      Once armed, the ring fills continuously until the trigger, then records
+//        PWM_CAPT_POST more entries and freezes, keeping what came just before the
+//        trigger as well. Triggers are by hand, on the first cycle after the output
+//        starts, or on a lost or skipped cycle.
+//
 //  EXAMPLE
 //
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -81,11 +119,57 @@
 // The only ICP on the Arduino is on Timer1
 //
 
+#define PWM_DUTY_EVERY  4                   // Cycles between duty measurements
+
+#define PWM_GATE_MIN_MS 10                  // Shortest gate (ms), one control frame
+#define PWM_GATE_MAX_MS 1000                // Longest  gate (ms)
+#define PWM_DEF_GATE_MS 100                 // Gate at startup (ms)
+
 //
-// No user configurable options
+// Raw capture ring buffer, for tuning builds. Costs 4 bytes of RAM per entry, which
+//   a normal build can't spare.
+//
+//#define USE_PWM_CAPTURE
+
+#define PWM_CAPT_SIZE   32                  // Entries in ring, must be a power of 2
+#define PWM_CAPT_POST   24                  // Entries to record after the trigger
+
+//
+// End of user configurable options
 //
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data definitions and macros
+//
+typedef struct {
+    uint16_t    Cycles;                             // Cycles measured in the window
+    uint16_t    Lost;                               // Cycles left out (missed edges)
+    uint16_t    MinPeriod;                          // Shortest cycle (CPU cycles)
+    uint16_t    MaxPeriod;                          // Longest  cycle (CPU cycles)
+    uint16_t    MinPWM;                             // Lowest  PWM sampled (% x 10)
+    uint16_t    MaxPWM;                             // Highest PWM sampled (% x 10)
+    uint16_t    Jitter;                             // Mean cycle to cycle change (ns)
+    } PWM_STATS;
+
+typedef struct {
+    uint16_t    Period;                             // Cycle period (CPU clocks)
+    uint16_t    High;                               // High time    (CPU clocks)
+    } PWM_CAPT;
+
+typedef enum {
+    TRIG_NOW = 1000,                                // Trigger by hand (PWMCaptTrigger)
+    TRIG_START,                                     // First cycle after output starts
+    TRIG_LOST,                                      // Lost or skipped cycle
+    } PWM_TRIG;
+
+typedef enum {
+    CAPT_IDLE = 1100,                               // Not recording, nothing saved
+    CAPT_ARMED,                                     // Recording, waiting for trigger
+    CAPT_TRIGGERED,                                 // Recording the post trigger part
+    CAPT_FROZEN,                                    // Done, ready to read
+    } PWM_CAPT_STATE;
+
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -126,4 +210,96 @@ uint16_t GetPWM (void);
 uint16_t GetPWMFreq(void);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGetStats - Return statistics for the last window
+//
+// Inputs:      Where to put the statistics
+//
+// Outputs:     None.
+//
+// NOTE: PWMUpdate() is called from the control tick, so keep it out while calling this
+//         (see DISABLE_CONTROL)
+//
+void PWMGetStats(PWM_STATS *Stats);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGate - Set gate time for the gated frequency
+//
+// Inputs:      Gate time (ms, PWM_GATE_MIN_MS to PWM_GATE_MAX_MS)
+//
+// Outputs:     None.
+//
+// The gate in progress is thrown away, and the next one starts at the next edge.
+//
+void PWMGate(uint16_t GateMS);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMGetGateFreq - Return frequency from the last gate
+//
+// Inputs:      None.
+//
+// Outputs:     Measured frequency, in Hz x 65536 (16.16 fixed point), 0 if none
+//
+// NOTE: Has a 64 bit divide, so call from the main loop only, with the control tick
+//         enabled.
+//
+uint32_t PWMGetGateFreq(void);
+
+
+#ifdef USE_PWM_CAPTURE
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptArm     - Clear the capture ring and start recording
+// PWMCaptTrigger - Trigger the capture by hand
+//
+// Inputs:      What to trigger on
+//
+// Outputs:     None.
+//
+// With TRIG_NOW the capture waits for PWMCaptTrigger()
+//
+void PWMCaptArm(PWM_TRIG Trigger);
+void PWMCaptTrigger(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptState - Return state of capture
+// PWMCaptCount - Return number of entries recorded
+// PWMCaptTrig  - Return index of the first entry after the trigger
+//
+// Inputs:      None.
+//
+// Outputs:     As above
+//
+PWM_CAPT_STATE PWMCaptState(void);
+uint8_t        PWMCaptCount(void);
+uint8_t        PWMCaptTrig (void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PWMCaptGet - Return one entry from a frozen capture
+//
+// Inputs:      Index of entry, 0 is oldest
+//              Where to put the entry
+//
+// Outputs:     TRUE  if entry returned
+//              FALSE if not frozen, or past the end
+//
+bool PWMCaptGet(uint8_t Index,PWM_CAPT *Entry);
+#endif // USE_PWM_CAPTURE
+
+
 #endif  // PWM_H - entire file
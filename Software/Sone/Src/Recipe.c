@@ -0,0 +1,505 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Recipe.c
+//
+//  DESCRIPTION
+//
+//      Recipe sequencer
+//
+//      Run a list of frequency/power/time steps stored in EEPROM.
+//
+//      See Recipe.h for an in-depth description
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#include <avr/eeprom.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Recipe.h"
+#include "EEPROM.h"
+#include "Timer.h"
+#include "Fault.h"
+
+#include "Serial.h"
+#include "SerialLong.h"
+#include "Command.h"
+#include "Parse.h"
+#include "MAScreen.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data declarations
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+RECIPE_CURR RecipeCurr NOINIT;
+
+//
+// Progress through the current step, in user interface ticks
+//
+static struct {
+    uint32_t    Ticks;                              // Ticks into the step
+    uint32_t    RampTicks;                          // Ticks to ramp power
+    uint32_t    EndTicks;                           // Ticks to end of step
+    uint16_t    FromPower;                          // Power at start of ramp
+    uint16_t    ToPower;                            // Power to ramp to and hold
+    } Step NOINIT;
+
+#define STEP_ADDR(_r_,_s_)  (&EEPROM_RECIPES[_r_].Steps[_s_])
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ReadStep - Read a recipe step from EEPROM
+//
+// Inputs:      Recipe to read
+//              Step to read
+//              Where to put it
+//
+// Outputs:     None.
+//
+static void ReadStep(uint8_t Recipe,uint8_t Index,RECIPE_STEP *RStep) {
+
+    eeprom_read_block(RStep,STEP_ADDR(Recipe,Index),sizeof(*RStep));
+    }
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeInit - Initialize recipe sequencer
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void RecipeInit(void) {
+
+    memset(&RecipeCurr,0,sizeof(RecipeCurr));
+    memset(&Step      ,0,sizeof(Step));
+
+    RecipeCurr.State = RECIPE_IDLE;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeReset - Clear all recipes in EEPROM
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void RecipeReset(void) {
+    RECIPE_STEP Blank;
+
+    memset(&Blank,0,sizeof(Blank));
+
+    for( uint8_t Recipe = 0; Recipe < MAX_RECIPES; Recipe++ ) {
+        for( uint8_t Index = 0; Index < MAX_RECIPE_STEPS; Index++ )
+            eeprom_update_block(&Blank,STEP_ADDR(Recipe,Index),sizeof(Blank));
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// StartStep - Start the current recipe step
+//
+// Inputs:      None.
+//
+// Outputs:     TRUE  if step was started
+//              FALSE if no more steps
+//
+static bool StartStep(void) {
+
+    RECIPE_STEP RStep;
+
+    if( RecipeCurr.Step >= MAX_RECIPE_STEPS )
+        return false;
+
+    ReadStep(RecipeCurr.Recipe,RecipeCurr.Step,&RStep);
+
+    if( RStep.RampTime == 0 && RStep.HoldTime == 0 )
+        return false;
+
+    Step.Ticks     = 0;
+    Step.RampTicks = (uint32_t) RStep.RampTime*TICKS_PER_SEC;
+    Step.EndTicks  = (uint32_t) RStep.HoldTime*TICKS_PER_SEC + Step.RampTicks;
+    Step.FromPower = TransducerSet.Power;
+    Step.ToPower   = RStep.Power;
+
+    TransducerFreq   (RStep.Freq);
+    TransducerRunMode(RStep.RunMode,TransducerSet.RunTimer);
+
+    if( Step.RampTicks == 0 )
+        TransducerPower(RStep.Power);
+
+    return true;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// StopRecipe - Stop the recipe and turn off the transducer
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void StopRecipe(void) {
+
+    RecipeCurr.State = RECIPE_IDLE;
+    RecipeCurr.Step  = 0;
+    TransducerOn(false);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeUpdate - Run the recipe sequencer
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void RecipeUpdate(void) {
+
+    //
+    // Waiting on a fault retry: carry on when the output comes back, or pause if the
+    //   retry was given up on or overridden.
+    //
+    if( RecipeCurr.State == RECIPE_RETRY ) {
+        if( TransducerCurr.On )
+            RecipeCurr.State = RECIPE_RUN;
+        else if( !FaultPending() )
+            RecipeCurr.State = RECIPE_PAUSED;
+        }
+
+    if( RecipeCurr.State != RECIPE_RUN )
+        return;
+
+    //
+    // If something else turned off the transducer, hold our place
+    //
+    if( !TransducerCurr.On ) {
+        RecipeCurr.State = FaultPending() ? RECIPE_RETRY : RECIPE_PAUSED;
+        return;
+        }
+
+    //
+    // Ramp the power linearly over the ramp time, then hold it
+    //
+    if( Step.Ticks < Step.RampTicks ) {
+        int32_t Delta = (int32_t) Step.ToPower - Step.FromPower;
+
+        TransducerPower(Step.FromPower + (Delta*(int32_t) Step.Ticks)/(int32_t) Step.RampTicks);
+        }
+    else if( Step.Ticks == Step.RampTicks )
+        TransducerPower(Step.ToPower);
+
+    if( ++Step.Ticks < Step.EndTicks )
+        return;
+
+    RecipeCurr.Step++;
+    if( !StartStep() )
+        StopRecipe();
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintState - Print out recipe state
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void PrintState(void) {
+
+    PrintStringP(PSTR("Recipe "));
+    PrintD(RecipeCurr.Recipe,0);
+
+    if( RecipeCurr.State == RECIPE_IDLE ) {
+        PrintStringP(PSTR(": idle\r\n"));
+        return;
+        }
+
+    if     ( RecipeCurr.State == RECIPE_RUN   ) PrintStringP(PSTR(": running step "));
+    else if( RecipeCurr.State == RECIPE_RETRY ) PrintStringP(PSTR(": fault retry at step "));
+    else                                        PrintStringP(PSTR(": paused at step "));
+    PrintD(RecipeCurr.Step,0);
+    PrintStringP(PSTR(", "));
+    PrintLD(Step.Ticks/TICKS_PER_SEC,0);
+    PrintStringP(PSTR(" of "));
+    PrintLD(Step.EndTicks/TICKS_PER_SEC,0);
+    PrintStringP(PSTR(" secs\r\n"));
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintRecipe - Print out recipe steps
+//
+// Inputs:      Recipe to print
+//
+// Outputs:     None.
+//
+static void PrintRecipe(uint8_t Recipe) {
+
+    StartMsg();
+    PrintState();
+
+    for( uint8_t Index = 0; Index < MAX_RECIPE_STEPS; Index++ ) {
+        RECIPE_STEP RStep;
+
+        ReadStep(Recipe,Index,&RStep);
+
+        if( RStep.RampTime == 0 && RStep.HoldTime == 0 )
+            break;
+
+        PrintD(Index,2);
+        PrintStringP(PSTR(": "));
+        PrintD(RStep.Freq,5);
+        PrintStringP(PSTR(" Hz, power "));
+        PrintD(RStep.Power,4);
+        PrintStringP(PSTR(", ramp "));
+        PrintD(RStep.RampTime,5);
+        PrintStringP(PSTR(", hold "));
+        PrintD(RStep.HoldTime,5);
+        if( RStep.RunMode == RUN_PULSED ) PrintStringP(PSTR(" secs, pulsed\r\n"));
+        else                              PrintStringP(PSTR(" secs\r\n"));
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// EditStep - Interpret the "RC ED" command
+//
+// Inputs:      None. Arguments are parsed from the command line
+//
+// Outputs:     None.
+//
+static void EditStep(void) {
+    char *StepText  = ParseToken();
+    char *FreqText  = ParseToken();
+    char *PowerText = ParseToken();
+    char *RampText  = ParseToken();
+    char *HoldText  = ParseToken();
+    char *ModeText  = ParseToken();
+    int   StepNum   = atoi(StepText);
+    RECIPE_STEP RStep;
+
+    if( !strlen(StepText) || StepNum < 0 || StepNum >= MAX_RECIPE_STEPS ) {
+        StartMsg();
+        PrintStringP(PSTR("Bad or out of range step number, must be 0 to "));
+        PrintD(MAX_RECIPE_STEPS-1,0);
+        PrintStringP(PSTR("\r\nType '?' for help\r\n"));
+        return;
+        }
+
+    //
+    // Accept a bare step number as a request to clear the step, which ends the recipe
+    //
+    if( !strlen(FreqText) ) {
+        memset(&RStep,0,sizeof(RStep));
+        RStep.RunMode = RUN_CONTINUOUS;
+        eeprom_update_block(&RStep,STEP_ADDR(RecipeCurr.Recipe,StepNum),sizeof(RStep));
+        StartMsg();
+        PrintStringP(PSTR("Cleared step "));
+        PrintD(StepNum,0);
+        return;
+        }
+
+    long FreqNum  = atol(FreqText);
+    long PowerNum = atol(PowerText);
+    long RampNum  = atol(RampText);
+    long HoldNum  = atol(HoldText);
+
+    if( FreqNum  < TRANSDUCER_MIN_FREQ  || FreqNum  > TRANSDUCER_MAX_FREQ  ||
+        PowerNum < TRANSDUCER_MIN_POWER || PowerNum > TRANSDUCER_MAX_POWER ||
+        RampNum  < 0 || RampNum > 0xFFFF ||
+        HoldNum  < 0 || HoldNum > 0xFFFF ||
+        (RampNum == 0 && HoldNum == 0)   ||
+        (strlen(ModeText) && !StrEQ(ModeText,"C") && !StrEQ(ModeText,"P")) ) {
+        StartMsg();
+        PrintStringP(PSTR("Bad recipe step, must be: step freq power ramp hold [C|P]\r\n"));
+        PrintStringP(PSTR("  with ramp and hold in secs, and not both zero.\r\n"));
+        PrintStringP(PSTR("Type '?' for help\r\n"));
+        return;
+        }
+
+    RStep.Freq     = FreqNum;
+    RStep.Power    = PowerNum;
+    RStep.RampTime = RampNum;
+    RStep.HoldTime = HoldNum;
+    RStep.RunMode  = StrEQ(ModeText,"P") ? RUN_PULSED : RUN_CONTINUOUS;
+    eeprom_update_block(&RStep,STEP_ADDR(RecipeCurr.Recipe,StepNum),sizeof(RStep));
+
+    StartMsg();
+    PrintStringP(PSTR("Set step "));
+    PrintD(StepNum,0);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeCmd - Manage typed recipe commands
+//
+// Inputs:      Command to interpret
+//
+// Outputs:     TRUE  if we understood and processed command
+//              FALSE if command isn't ours, belongs to another system
+//
+bool RecipeCmd(char *Command) {
+
+    if( !StrEQ(Command,"RC") )
+        return false;
+
+    Command = ParseToken();
+
+    //
+    // Accept blank "RC" command as a request to print the current recipe
+    //
+    if( !strlen(Command) ) {
+        PrintRecipe(RecipeCurr.Recipe);
+        return true;
+        }
+
+    //
+    // LO - Select recipe to run and edit
+    //
+    if( StrEQ(Command,"LO") ) {
+        char *RecipeText = ParseToken();
+        int   RecipeNum  = atoi(RecipeText);
+
+        if( RecipeCurr.State != RECIPE_IDLE ) {
+            StartMsg();
+            PrintStringP(PSTR("Stop the running recipe first (RC ST)"));
+            return true;
+            }
+
+        if( !strlen(RecipeText) || RecipeNum < 0 || RecipeNum >= MAX_RECIPES ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range recipe number, must be 0 to "));
+            PrintD(MAX_RECIPES-1,0);
+            PrintStringP(PSTR("\r\nType '?' for help\r\n"));
+            return true;
+            }
+
+        RecipeCurr.Recipe = RecipeNum;
+        PrintRecipe(RecipeCurr.Recipe);
+        return true;
+        }
+
+    //
+    // ED - Edit (or clear) a recipe step
+    //
+    if( StrEQ(Command,"ED") ) {
+        if( RecipeCurr.State != RECIPE_IDLE ) {
+            StartMsg();
+            PrintStringP(PSTR("Stop the running recipe first (RC ST)"));
+            return true;
+            }
+
+        EditStep();
+        return true;
+        }
+
+    //
+    // GO - Start, or continue a paused recipe
+    //
+    if( StrEQ(Command,"GO") ) {
+
+        if( RecipeCurr.State == RECIPE_IDLE ) {
+            RecipeCurr.Step = 0;
+            if( !StartStep() ) {
+                StartMsg();
+                PrintStringP(PSTR("Recipe is empty"));
+                return true;
+                }
+            }
+
+        TransducerOn(true);
+
+        if( TransducerWhyOff() ) {
+            RecipeCurr.State = RECIPE_PAUSED;
+            return true;
+            }
+
+        RecipeCurr.State = RECIPE_RUN;
+        StartMsg();
+        PrintState();
+        return true;
+        }
+
+    //
+    // PA - Pause recipe
+    //
+    if( StrEQ(Command,"PA") ) {
+        if( RecipeCurr.State == RECIPE_RUN || RecipeCurr.State == RECIPE_RETRY ) {
+            RecipeCurr.State = RECIPE_PAUSED;
+            TransducerOn(false);
+            }
+        StartMsg();
+        PrintState();
+        return true;
+        }
+
+    //
+    // ST - Stop recipe
+    //
+    if( StrEQ(Command,"ST") ) {
+        if( RecipeCurr.State != RECIPE_IDLE )
+            StopRecipe();
+        StartMsg();
+        PrintState();
+        return true;
+        }
+
+    StartMsg();
+    PrintStringP(PSTR("Unrecognized recipe argument ("));
+    PrintString(Command);
+    PrintStringP(PSTR(")\r\n"));
+    PrintStringP(PSTR("Type '?' for help\r\n"));
+    return true;
+    }
@@ -0,0 +1,189 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//      Copyright (C) 2015 Peter Walsh, Milford, NH 03055
+//      All Rights Reserved under the MIT license as outlined below.
+//
+//  FILE
+//      Recipe.h
+//
+//  SYNOPSIS
+//
+//      //////////////////////////////////////
+//      //
+//      // In Recipe.h
+//      //
+//      ...Choose number of recipes        (Default: 4)
+//      ...Choose steps per recipe         (Default: 8)
+//
+//      //////////////////////////////////////
+//      //
+//      // In Main.c
+//      //
+//      SetupInit();
+//      RecipeInit();
+//
+//      //////////////////////////////////////
+//      //
+//      // In TransducerUpdate()
+//      //
+//      RecipeUpdate();                     // Called at user interface tick rate
+//
+//      //////////////////////////////////////
+//      //
+//      // Typed commands
+//      //
+//      RecipeCmd(Command);                 // Process RC commands
+//
+//  DESCRIPTION
+//
+//      Recipe sequencer
+//
+//      A recipe is a list of steps, each of which sets the frequency and run mode, then
+//        ramps the power from wherever it was to a new value and holds it there for a
+//        time. For example:
+//
+//          Step 0: 28000 Hz, 20 W, ramp  0 secs, hold  30 secs, continuous
+//          Step 1: 28000 Hz, 60 W, ramp 10 secs, hold 120 secs, continuous
+//          Step 2: 28000 Hz, 60 W, ramp  0 secs, hold 300 secs, pulsed
+//
+//      Pulsed steps use the pulse on and off times from the current setup.
+//
+//      The recipe ends at the first empty step (no ramp and no hold time), or after
+//        the last step, whereupon the transducer is turned off.
+//
+//      Recipes are kept in the EEPROM (see EEPROM.h), after the setups. There's no RAM
+//        copy: steps are read as they're needed, and written as they're edited.
+//
+//      If the transducer is turned off while a recipe is running (by EStop, an input,
+//        or the OFF command), the recipe is paused, and can be continued with RC GO.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+//  MIT LICENSE
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy of
+//    this software and associated documentation files (the "Software"), to deal in
+//    the Software without restriction, including without limitation the rights to
+//    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+//    of the Software, and to permit persons to whom the Software is furnished to do
+//    so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//    all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+//    INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A
+//    PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+//    HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+//    OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+//    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Transducer.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Recipe table size. Each step takes 9 bytes of EEPROM.
+//
+#define MAX_RECIPES         4
+#define MAX_RECIPE_STEPS    8
+
+//
+// End of user configurable options
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Data definitions and macros
+//
+typedef struct {
+    uint16_t            Freq;       // Frequency (Hz)
+    uint16_t            Power;      // Power to ramp to and hold (watts x 10)
+    uint16_t            RampTime;   // Time to ramp from previous power (secs)
+    uint16_t            HoldTime;   // Time to hold the power (secs)
+    TRANSDUCER_RUN_MODE RunMode;    // RUN_CONTINUOUS or RUN_PULSED
+    } RECIPE_STEP;
+
+typedef struct {
+    RECIPE_STEP     Steps[MAX_RECIPE_STEPS];
+    } RECIPE;
+
+typedef enum {
+    RECIPE_IDLE = 500,              // Not running
+    RECIPE_RUN,                     // Running a step
+    RECIPE_PAUSED,                  // Stopped partway, can be continued
+    RECIPE_RETRY,                   // Stopped by a fault, continues if the retry works
+    } RECIPE_STATE;
+
+typedef struct {
+    uint8_t         Recipe;         // Selected recipe
+    uint8_t         Step;           // Step being run
+    RECIPE_STATE    State;          // What we're doing
+    } RECIPE_CURR;
+
+extern RECIPE_CURR RecipeCurr;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeInit - Initialize recipe sequencer
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+void RecipeInit(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeReset - Clear all recipes in EEPROM
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Called from SetupInit() when the EEPROM layout changes
+//
+void RecipeReset(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeUpdate - Run the recipe sequencer
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Called from TransducerUpdate() at user interface tick rate
+//
+void RecipeUpdate(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RecipeCmd - Manage typed recipe commands
+//
+// Inputs:      Command to interpret
+//
+// Outputs:     TRUE  if we understood and processed command
+//              FALSE if command isn't ours, belongs to another system
+//
+bool RecipeCmd(char *Command);
+
+
+#endif  // RECIPE_H - entire file
@@ -154,6 +154,15 @@ void ShowScreen(int ScreenType) {
             return;
 #endif
 
+#ifdef USE_FAULT_SCREEN
+        //
+        // FA - Show the fault screen
+        //
+        case 'FA':
+            ShowFAScreen();
+            return;
+#endif
+
 #ifdef USE_MEMORY_SCREEN
         //
         // ME - Show the memory screen
@@ -230,6 +239,15 @@ void ScreenUpdate(void) {
             return;
 #endif
 
+#ifdef USE_FAULT_SCREEN
+        //
+        // FA - Update the fault screen
+        //
+        case 'FA':
+            UpdateFAScreen();
+            return;
+#endif
+
 #ifdef USE_MEMORY_SCREEN
         //
         // ME - Update the memory screen
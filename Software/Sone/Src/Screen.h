@@ -74,6 +74,7 @@
 #define USE_MAIN_SCREEN
 #define USE_HELP_SCREEN
 #define USE_DEBUG_SCREEN
+#define USE_FAULT_SCREEN
 //#define USE_MEMORY_SCREEN
 //#define USE_EEPROM_SCREEN
 
@@ -85,6 +86,7 @@
 #define USE_MAIN_SCREEN_CMDS
 //#define USE_HELP_SCREEN_CMDS
 //#define USE_DEBUG_SCREEN_CMDS
+//#define USE_FAULT_SCREEN_CMDS
 //#define USE_MEMORY_SCREEN_CMDS
 //#define USE_EEPROM_SCREEN_CMDS
 
@@ -141,6 +143,10 @@ extern int  SelectedScreen;
 #   include "HEScreen.h"
 #   endif
 
+#ifdef USE_FAULT_SCREEN
+#   include "FAScreen.h"
+#   endif
+
 #ifdef USE_MEMORY_SCREEN
 #   include "MEScreen.h"
 #   endif
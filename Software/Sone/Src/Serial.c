@@ -229,6 +229,26 @@ void PrintD(uint16_t Value,int8_t Width) {
     }
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintSD - Printf signed short integer with %d format
+//
+// Inputs:      Integer to convert
+//              Width of field, as with PrintD (not counting any '-' sign)
+//
+// Outputs:     None.
+//
+void PrintSD(int16_t Value,int8_t Width) {
+
+    if( Value < 0 ) {
+        PrintChar('-');
+        PrintD(-Value,Width);
+        }
+    else PrintD(Value,Width);
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
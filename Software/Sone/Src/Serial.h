@@ -143,6 +143,19 @@ void PrintStringP(PGM_P String);
 void PrintD (uint16_t Value,int8_t Width);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintSD - Printf signed short integer with %d format
+//
+// Inputs:      Integer to convert
+//              Width of field, as with PrintD (not counting any '-' sign)
+//
+// Outputs:     None.
+//
+void PrintSD(int16_t Value,int8_t Width);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
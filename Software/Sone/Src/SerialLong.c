@@ -104,7 +104,7 @@ void PrintLD(uint32_t Value,int8_t Width) {
 
         if( OutChar != '0' || CharsPrinted ) {
             if( CharsPrinted == 0 && Width > 0 ) {
-                uint8_t Chars = 5-Index;
+                uint8_t Chars = 10-Index;
                 if( Width < Chars )
                     Width = Chars;
                 while( Width > Chars ) {
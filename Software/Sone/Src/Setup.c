@@ -50,6 +50,7 @@
 #include "EEPROM.h"
 
 #include "Serial.h"
+#include "SerialLong.h"
 #include "Command.h"
 #include "Parse.h"
 #include "MAScreen.h"
@@ -66,13 +67,35 @@ uint8_t CurrSetup NOINIT;
 
 PROGMEM SETUP SetupDefaults = {
     { 28000, 20,                // Default output freq, power
+      TRANSDUCER_DEF_CURRENT,   // Default output current
+      TRANSDUCER_DEF_SLEW,      //   and slew limit
+      TRANSDUCER_DEF_PWR_KP,    // Default power regulator gains
+      TRANSDUCER_DEF_PWR_KI,
+      TRANSDUCER_DEF_PWR_DB,
       RUN_CONTINUOUS, 0,        // Default run mode and run timer
+      100, 100, 0,              // Default pulse on, off, and count
+      TRANSDUCER_DEF_DOSE,      // Default energy dose
       CTL_CONST_FREQ,           // Constant frequency
+      TRANSDUCER_DEF_TRACK,     // Default tracking step
+      0,                        // No headroom retune
+      TRANSDUCER_DEF_DITHER_DEV,// Default FM dither deviation,
+      TRANSDUCER_DEF_DITHER_RATE,//  rate,
+      DITHER_TRIANGLE,          //   and shape
+      false,                    // No resonance search at turn on
+      0, 0,                     // No thermal drift model
+      TRANSDUCER_DEF_DRIFT_MAX, //   and default drift limit
+      0,                        // No thermal model,
+      TRANSDUCER_DEF_THERM_HEAT,//   default time constants,
+      TRANSDUCER_DEF_THERM_COOL,
+      TRANSDUCER_DEF_THERM_DERATE,// and limits
+      TRANSDUCER_DEF_THERM_TRIP,
+      LOAD_FLAG, 0, 0,          // Load classifier uncalibrated, flag only
+      RAMP_NONE,                // No soft start/stop
+      TRANSDUCER_DEF_RAMP,      // Default ramp time
       { INPUT_UNUSED, 0 },      // Default action for Input1
       { INPUT_UNUSED, 0 },      // Default action for Input2
       }
     };
-
 
 //
 // Per the WINAVR definition of PROGMEM, we must explicitly put each string into PROGMEM
@@ -89,9 +112,27 @@ static char *InputActionText[NUM_ACTIONS] = {
 
 static char PMT1[] PROGMEM = "Constant freq";
 static char PMT2[] PROGMEM = "Max efficiency";
+static char PMT3[] PROGMEM = "FM dither";
+static char PMT4[] PROGMEM = "Constant current";
 
 static char *CtlModeText[NUM_CTL_MODES]= {
-    PMT1, PMT2
+    PMT1, PMT2, PMT3, PMT4
+    };
+
+static char RMT1[] PROGMEM = "None";
+static char RMT2[] PROGMEM = "Linear";
+static char RMT3[] PROGMEM = "S-curve";
+
+static char *RampModeText[NUM_RAMP_MODES]= {
+    RMT1, RMT2, RMT3
+    };
+
+static char LPT1[] PROGMEM = "Flag";
+static char LPT2[] PROGMEM = "Derate";
+static char LPT3[] PROGMEM = "Stop";
+
+static char *LoadPolicyText[NUM_LOAD_POLICIES]= {
+    LPT1, LPT2, LPT3
     };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -114,9 +155,17 @@ void SetupInit(void) {
     if( EEPROM.Version != EEPROM_CURR_VERSION ) {
         for( CurrSetup = 0; CurrSetup < MAX_SETUPS; CurrSetup++ )
             memcpy_P(&EEPROM.Setups[CurrSetup],&SetupDefaults,sizeof(SetupDefaults));
+
+        TransducerResetMap();
+
+        RecipeReset();
+
+        ACS712ResetCal();
+
         EEPROM.Version = EEPROM_CURR_VERSION;
         EEPROMWrite();
         }
+    ACS712UseCal();
 
     LoadSetup(0);
     }
@@ -134,8 +183,8 @@ void SetupInit(void) {
 void LoadSetup(uint8_t Setup) {
 
     CurrSetup = Setup;
-    TransducerSet = EEPROM.Setups[Setup].Setup;
-    TransducerSetup();
+
+    TransducerSwitch(&EEPROM.Setups[Setup].Setup);
     }
 
 
@@ -204,9 +253,34 @@ static void PrintSetup(uint8_t SetupID,TRANSDUCER_SET *Setup) {
     PrintD(Setup->Power,3);
     PrintStringP(PSTR(" Watts\r\n"));
 
+    PrintStringP(PSTR("Power loop: Kp "));
+    PrintD(Setup->PwrKp,0);
+    PrintStringP(PSTR(", Ki "));
+    PrintD(Setup->PwrKi,0);
+    PrintStringP(PSTR(", deadband "));
+    PrintD(Setup->PwrDB,0);
+    PrintCRLF();
+
     PrintStringP(PSTR("Output: "));
     if( Setup->RunMode == RUN_CONTINUOUS )
         PrintStringP(PSTR("Continuous\r\n"));
+    else if( Setup->RunMode == RUN_PULSED ) {
+        PrintStringP(PSTR("Pulsed "));
+        PrintD(Setup->PulseOn,0);
+        PrintStringP(PSTR("ms on, "));
+        PrintD(Setup->PulseOff,0);
+        PrintStringP(PSTR("ms off, "));
+        if( Setup->PulseCount ) {
+            PrintD(Setup->PulseCount,0);
+            PrintStringP(PSTR(" pulses\r\n"));
+            }
+        else PrintStringP(PSTR("forever\r\n"));
+        }
+    else if( Setup->RunMode == RUN_ENERGY ) {
+        PrintStringP(PSTR("Energy "));
+        PrintLD(Setup->Energy,0);
+        PrintStringP(PSTR(" joules\r\n"));
+        }
     else {
         PrintStringP(PSTR("Timed "));
         PrintD(Setup->RunTimer,5);
@@ -215,6 +289,83 @@ static void PrintSetup(uint8_t SetupID,TRANSDUCER_SET *Setup) {
 
     PrintStringP(PSTR("Control: "));
     PrintStringP(CtlModeText[IDX_CTL_MODE(Setup->CtlMode)]);
+    if( Setup->CtlMode == CTL_MAX_EFF ) {
+        PrintStringP(PSTR(", step "));
+        PrintD(Setup->TrackStep,0);
+        PrintStringP(PSTR("Hz"));
+        }
+    if( Setup->CtlMode == CTL_FREQ_MOD ) {
+        PrintStringP(PSTR(" +/-"));
+        PrintD(Setup->DitherDev,0);
+        PrintStringP(PSTR("Hz at "));
+        PrintD(Setup->DitherRate,0);
+        if( Setup->DitherWave == DITHER_RANDOM ) PrintStringP(PSTR("Hz random"));
+        else                                     PrintStringP(PSTR("Hz triangle"));
+        }
+    if( Setup->CtlMode == CTL_CONST_CURRENT ) {
+        PrintStringP(PSTR(", "));
+        PrintD(Setup->Current/10,0);
+        PrintChar('.');
+        PrintD(Setup->Current%10,0);
+        PrintStringP(PSTR(" amps, slew "));
+        PrintD(Setup->CurrentSlew/10,0);
+        PrintChar('.');
+        PrintD(Setup->CurrentSlew%10,0);
+        PrintStringP(PSTR(" amps/sec"));
+        }
+    if( Setup->Acquire )
+        PrintStringP(PSTR(", search at turn on"));
+    if( Setup->RetuneMax && Setup->CtlMode != CTL_MAX_EFF ) {
+        PrintStringP(PSTR(", retune "));
+        PrintD(Setup->RetuneMax,0);
+        PrintStringP(PSTR("Hz when power limited"));
+        }
+    PrintCRLF();
+
+    PrintStringP(PSTR("Drift: "));
+    PrintSD(Setup->DriftTime,0);
+    PrintStringP(PSTR("mHz/sec, "));
+    PrintSD(Setup->DriftEnergy,0);
+    PrintStringP(PSTR("mHz/kJ, max "));
+    PrintD(Setup->DriftMax,0);
+    PrintStringP(PSTR("Hz\r\n"));
+
+    PrintStringP(PSTR("Thermal: "));
+    if( Setup->ThermRated ) {
+        PrintStringP(PSTR("rated "));
+        PrintD(Setup->ThermRated/10,0);
+        PrintChar('.');
+        PrintD(Setup->ThermRated%10,0);
+        PrintStringP(PSTR(" amps, heat "));
+        PrintD(Setup->ThermHeat,0);
+        PrintStringP(PSTR(" secs, cool "));
+        PrintD(Setup->ThermCool,0);
+        PrintStringP(PSTR(" secs, derate "));
+        PrintD(Setup->ThermDerate,0);
+        PrintStringP(PSTR("%, trip "));
+        PrintD(Setup->ThermTrip,0);
+        PrintStringP(PSTR("%\r\n"));
+        }
+    else PrintStringP(PSTR("off\r\n"));
+
+    PrintStringP(PSTR("Load: "));
+    PrintStringP(LoadPolicyText[IDX_LOAD_POLICY(Setup->LoadPolicy)]);
+    if( Setup->LoadDry && Setup->LoadNormal ) {
+        PrintStringP(PSTR(" when dry or overloaded, dry "));
+        PrintD(Setup->LoadDry,0);
+        PrintStringP(PSTR(", normal "));
+        PrintD(Setup->LoadNormal,0);
+        PrintCRLF();
+        }
+    else PrintStringP(PSTR(", not calibrated\r\n"));
+
+    PrintStringP(PSTR("Ramp: "));
+    PrintStringP(RampModeText[IDX_RAMP_MODE(Setup->RampMode)]);
+    if( Setup->RampMode != RAMP_NONE ) {
+        PrintStringP(PSTR(", "));
+        PrintD(Setup->RampTime,0);
+        PrintStringP(PSTR("ms"));
+        }
 
     PrintInputMode(1,&Setup->Input1);
     PrintInputMode(2,&Setup->Input2);
@@ -373,6 +524,68 @@ static void ModeCmd(char *Command) {
         return;
         }
 
+    //
+    // RP - Set pulsed run mode
+    //
+    if( StrEQ(Command,"RP") ) {
+        char *OnText    = ParseToken();
+        char *OffText   = ParseToken();
+        char *CountText = ParseToken();
+        long  OnMS      = atol(OnText);
+        long  OffMS     = atol(OffText);
+        long  Count     = atol(CountText);
+
+        if( !strlen(OnText)  || OnMS  < 1 || OnMS  > 60000 ||
+            !strlen(OffText) || OffMS < 1 || OffMS > 60000 ||
+            Count < 0 || Count > 60000 ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range pulse timing, must be on and off times\r\n"));
+            PrintStringP(PSTR("  of 1 to 60000 ms, and optional count of 0 to 60000.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Run pulsed "));
+        PrintD(OnMS,0);
+        PrintStringP(PSTR("ms on, "));
+        PrintD(OffMS,0);
+        PrintStringP(PSTR("ms off"));
+        if( Count ) {
+            PrintStringP(PSTR(", "));
+            PrintD(Count,0);
+            PrintStringP(PSTR(" pulses"));
+            }
+        TransducerPulse(OnMS,OffMS,Count);
+        TransducerRunMode(RUN_PULSED,TransducerSet.RunTimer);
+        return;
+        }
+
+    //
+    // RE - Set energy dose run mode
+    //
+    if( StrEQ(Command,"RE") ) {
+        char *DoseText = ParseToken();
+        long  Joules   = atol(DoseText);
+
+        if( !strlen(DoseText) || Joules < 1 || Joules > TRANSDUCER_MAX_DOSE ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range energy dose, must be 1 to "));
+            PrintLD(TRANSDUCER_MAX_DOSE,0);
+            PrintStringP(PSTR(" joules.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Run until "));
+        PrintLD(Joules,0);
+        PrintStringP(PSTR(" joules delivered"));
+        TransducerDose(Joules);
+        TransducerRunMode(RUN_ENERGY,TransducerSet.RunTimer);
+        return;
+        }
+
 
     //
     // CF - Constant frequency
@@ -384,6 +597,243 @@ static void ModeCmd(char *Command) {
         return;
         }
 
+    //
+    // ME - Max efficiency, with optional tracking step
+    //
+    if( StrEQ(Command,"ME") ) {
+        char *StepText = ParseToken();
+        int   StepHz   = TransducerSet.TrackStep;
+
+        if( strlen(StepText) )
+            StepHz = atoi(StepText);
+
+        if( StepHz < 1 ||
+            StepHz > TRANSDUCER_MAX_TRACK ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range tracking step ("));
+            PrintString(StepText);
+            PrintStringP(PSTR("), must be 1 to "));
+            PrintD(TRANSDUCER_MAX_TRACK,0);
+            PrintCRLF();
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Max efficiency mode, step "));
+        PrintD(StepHz,0);
+        PrintStringP(PSTR("Hz"));
+        TransducerTrackStep(StepHz);
+        TransducerCtlMode(CTL_MAX_EFF);
+        return;
+        }
+
+    //
+    // FM - FM dither, with optional deviation, rate, and shape
+    //
+    if( StrEQ(Command,"FM") ) {
+        char                  *DevText  = ParseToken();
+        char                  *RateText = ParseToken();
+        char                  *WaveText = ParseToken();
+        long                   Dev      = TransducerSet.DitherDev;
+        long                   Rate     = TransducerSet.DitherRate;
+        TRANSDUCER_DITHER_WAVE Wave     = TransducerSet.DitherWave;
+
+        if( strlen(DevText)  ) Dev  = atol(DevText);
+        if( strlen(RateText) ) Rate = atol(RateText);
+
+        if     ( StrEQ(WaveText,"T") ) Wave = DITHER_TRIANGLE;
+        else if( StrEQ(WaveText,"R") ) Wave = DITHER_RANDOM;
+        else if( strlen(WaveText)    ) {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized dither shape ("));
+            PrintString(WaveText);
+            PrintStringP(PSTR("), must be T or R.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        if( Dev  < 1 || Dev  > TRANSDUCER_MAX_DITHER_DEV ||
+            Rate < 1 || Rate > TRANSDUCER_MAX_DITHER_RATE ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range dither, must be deviation of 1 to "));
+            PrintD(TRANSDUCER_MAX_DITHER_DEV,0);
+            PrintStringP(PSTR(" Hz\r\n  and rate of 1 to "));
+            PrintD(TRANSDUCER_MAX_DITHER_RATE,0);
+            PrintStringP(PSTR(" Hz.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("FM dither mode, +/-"));
+        PrintD(Dev,0);
+        PrintStringP(PSTR("Hz at "));
+        PrintD(Rate,0);
+        if( Wave == DITHER_RANDOM ) PrintStringP(PSTR("Hz random"));
+        else                        PrintStringP(PSTR("Hz triangle"));
+        TransducerDither(Dev,Rate,Wave);
+        TransducerCtlMode(CTL_FREQ_MOD);
+        return;
+        }
+
+    //
+    // CC - Constant current, with optional current and slew limit
+    //
+    if( StrEQ(Command,"CC") ) {
+        char *CurrentText = ParseToken();
+        char *SlewText    = ParseToken();
+        long  Current     = TransducerSet.Current;
+        long  Slew        = TransducerSet.CurrentSlew;
+
+        if( strlen(CurrentText) ) Current = atol(CurrentText);
+        if( strlen(SlewText)    ) Slew    = atol(SlewText);
+
+        if( Current < 0 || Current > TRANSDUCER_MAX_CURRENT ||
+            Slew    < 0 || Slew    > 60000 ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range current, must be 0 to "));
+            PrintD(TRANSDUCER_MAX_CURRENT,0);
+            PrintStringP(PSTR(" (amps x 10),\r\n  and slew of 0 to 60000 (amps x 10 per sec).\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Constant current mode, "));
+        PrintD(Current,0);
+        PrintStringP(PSTR(" (amps x 10), slew "));
+        PrintD(Slew,0);
+        PrintStringP(PSTR("/sec"));
+        TransducerCurrent(Current,Slew);
+        TransducerCtlMode(CTL_CONST_CURRENT);
+        return;
+        }
+
+    //
+    // HR - Headroom retune when power limited, up to # Hz (0 == off)
+    //
+    if( StrEQ(Command,"HR") ) {
+        char *MaxText = ParseToken();
+        int   MaxHz   = atoi(MaxText);
+
+        if( !strlen(MaxText) ||
+            MaxHz < 0        ||
+            MaxHz > TRANSDUCER_MAX_RETUNE ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range retune limit ("));
+            PrintString(MaxText);
+            PrintStringP(PSTR("), must be 0 to "));
+            PrintD(TRANSDUCER_MAX_RETUNE,0);
+            PrintCRLF();
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        if( MaxHz ) {
+            PrintStringP(PSTR("Retune up to "));
+            PrintD(MaxHz,0);
+            PrintStringP(PSTR("Hz when power limited"));
+            }
+        else PrintStringP(PSTR("No retune when power limited"));
+        TransducerRetune(MaxHz);
+        return;
+        }
+
+    //
+    // AQ - Resonance search at turn on
+    //
+    if( StrEQ(Command,"AQ") ) {
+        char *AcqText = ParseToken();
+
+        if( !StrEQ(AcqText,"Y") && !StrEQ(AcqText,"N") ) {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized search option ("));
+            PrintString(AcqText);
+            PrintStringP(PSTR("), must be Y or N.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        if( StrEQ(AcqText,"Y") ) PrintStringP(PSTR("Search for resonance at turn on"));
+        else                     PrintStringP(PSTR("No resonance search at turn on"));
+        TransducerAcquire(StrEQ(AcqText,"Y"));
+        return;
+        }
+
+    //
+    // LP - Load policy, for when the horn is dry or overloaded
+    //
+    if( StrEQ(Command,"LP") ) {
+        char                  *PolicyText = ParseToken();
+        TRANSDUCER_LOAD_POLICY Policy;
+
+        if     ( StrEQ(PolicyText,"F") ) Policy = LOAD_FLAG;
+        else if( StrEQ(PolicyText,"D") ) Policy = LOAD_DERATE;
+        else if( StrEQ(PolicyText,"S") ) Policy = LOAD_STOP;
+        else {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized load policy ("));
+            PrintString(PolicyText);
+            PrintStringP(PSTR("), must be F, D, or S.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Load policy "));
+        PrintStringP(LoadPolicyText[IDX_LOAD_POLICY(Policy)]);
+        TransducerLoad(Policy,TransducerSet.LoadDry,TransducerSet.LoadNormal);
+        return;
+        }
+
+    //
+    // RA - Soft start/stop ramp, with optional ramp time
+    //
+    if( StrEQ(Command,"RA") ) {
+        char                *RampText = ParseToken();
+        char                *TimeText = ParseToken();
+        long                 RampMS   = TransducerSet.RampTime;
+        TRANSDUCER_RAMP_MODE RampMode;
+
+        if     ( StrEQ(RampText,"N") ) RampMode = RAMP_NONE;
+        else if( StrEQ(RampText,"L") ) RampMode = RAMP_LINEAR;
+        else if( StrEQ(RampText,"S") ) RampMode = RAMP_SCURVE;
+        else {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized ramp mode ("));
+            PrintString(RampText);
+            PrintStringP(PSTR("), must be N, L, or S.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        if( strlen(TimeText) )
+            RampMS = atol(TimeText);
+
+        if( RampMS < 0 || RampMS > 60000 ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range ramp time ("));
+            PrintString(TimeText);
+            PrintStringP(PSTR("), must be 0 to 60000 ms.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Ramp "));
+        PrintStringP(RampModeText[IDX_RAMP_MODE(RampMode)]);
+        if( RampMode != RAMP_NONE ) {
+            PrintStringP(PSTR(", "));
+            PrintD(RampMS,0);
+            PrintStringP(PSTR("ms"));
+            }
+        TransducerRamp(RampMode,RampMS);
+        return;
+        }
+
     //
     // Ix - Set input action
     //
@@ -436,6 +886,8 @@ bool SetupCmd(char *Command) {
         StartMsg();
         PrintStringP(PSTR("Loaded setup "));
         PrintD(CurrSetup,0);            // == %d
+        if( TransducerCurr.Switching )
+            PrintStringP(PSTR(", switching over while running"));
         return true;
         }
 
@@ -46,6 +46,9 @@
 #include "Debug.h"
 #include "Transducer.h"
 #include "Setup.h"
+#include "Recipe.h"
+#include "Control.h"
+#include "Fault.h"
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -76,13 +79,17 @@ int __attribute__((OS_main)) main(void) {
 
     sei();                              // Enable interrupts
 
+    FaultInit();
     TransducerInit();
     SetupInit();
+    RecipeInit();
     ScreenInit();
     CommandInit();
 
     LoadSetup(0);
 
+    ControlInit();                      // Start measurement and control
+
     //////////////////////////////////////////////////////////////////////////////////////
     //
     // All done with init,
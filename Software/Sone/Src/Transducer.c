@@ -42,15 +42,21 @@
 #include <string.h>
 
 #include "Transducer.h"
+#include "EEPROM.h"
 #include "AD9833.h"
 #include "ACS712.h"
+#include "ADC.h"
 #include "SPIInline.h"
 #include "SG3525.h"
 #include "PWM.h"
 #include "Inputs.h"
 #include "Outputs.h"
+#include "Control.h"
+#include "Recipe.h"
+#include "Timer.h"
+#include "Fault.h"
 
-#ifdef SHOW_PWR_TUNING
+#if defined(SHOW_PWR_TUNING) || defined(SHOW_FREQ_TUNING)
 #include "Serial.h"
 #endif
 
@@ -67,12 +73,244 @@ TRANSDUCER_CURR TransducerCurr NOINIT;
 
 PROGMEM TRANSDUCER_SET TransducerDefaults = {
     TRANSDUCER_DEF_FREQ, 20,    // Default output freq, power
+    TRANSDUCER_DEF_CURRENT,     // Default output current
+    TRANSDUCER_DEF_SLEW,        //   and slew limit
+    TRANSDUCER_DEF_PWR_KP,      // Default power regulator gains
+    TRANSDUCER_DEF_PWR_KI,
+    TRANSDUCER_DEF_PWR_DB,
     RUN_CONTINUOUS, 0,          // Default run mode and run timer
+    100, 100, 0,                // Default pulse on, off, and count
+    TRANSDUCER_DEF_DOSE,        // Default energy dose
     CTL_CONST_FREQ,             // Constant frequency
+    TRANSDUCER_DEF_TRACK,       // Default tracking step
+    0,                          // No headroom retune
+    TRANSDUCER_DEF_DITHER_DEV,  // Default FM dither deviation,
+    TRANSDUCER_DEF_DITHER_RATE, //   rate,
+    DITHER_TRIANGLE,            //   and shape
+    false,                      // No resonance search at turn on
+    0, 0,                       // No thermal drift model
+    TRANSDUCER_DEF_DRIFT_MAX,   //   and default drift limit
+    0,                          // No thermal model,
+    TRANSDUCER_DEF_THERM_HEAT,  //   default time constants,
+    TRANSDUCER_DEF_THERM_COOL,
+    TRANSDUCER_DEF_THERM_DERATE,//   and limits
+    TRANSDUCER_DEF_THERM_TRIP,
+    LOAD_FLAG, 0, 0,            // Load classifier uncalibrated, flag only
+    RAMP_NONE,                  // No soft start/stop
+    TRANSDUCER_DEF_RAMP,        // Default ramp time
     { INPUT_UNUSED, 0 },        // Default action for Input1
     { INPUT_UNUSED, 0 },        // Default action for Input2
     };
 
+//
+// Resonance tracker state, for CTL_MAX_EFF
+//
+static struct {
+    uint16_t    Current;                            // Current at previous step
+    uint16_t    PWM;                                // PWM     at previous step
+    int8_t      Dir;                                // Direction of travel (+1/-1)
+    uint8_t     Settle;                             // Ticks until next comparison
+    uint8_t     Run;                                // Steps since last reversal
+    uint8_t     Reversals;                          // Consecutive short reversals
+    } Track NOINIT;
+
+//
+// Headroom retune state, for the fixed frequency modes when power limited
+//
+static struct {
+    uint16_t    Current;                            // Current at previous step
+    uint16_t    PWM;                                // PWM     at previous step
+    int8_t      Dir;                                // Direction of travel (+1/-1)
+    uint8_t     Settle;                             // Frames until next step
+    uint8_t     Limited;                            // Frames out of PWM
+    } Retune NOINIT;
+
+//
+// Stack thermal model state. Temp is the modelled heat, where 1.0 is running steadily
+//   at the rated current. The constants are worked out when the model is set, so the
+//   per frame update needs no divides.
+//
+static struct {
+    uint32_t    Temp;                               // Modelled heat       (x 2^16)
+    int32_t     Frac;                               // Fraction of Temp    (x 2^16)
+    uint32_t    RecipRated;                         // 1/rated current     (x 2^16)
+    uint32_t    KHeat;                              // 1/heating frames    (x 2^24)
+    uint32_t    KCool;                              // 1/cooling frames    (x 2^24)
+    uint32_t    Derate;                             // Heat to derate from (x 2^16)
+    uint32_t    Trip;                               // Heat to trip at     (x 2^16)
+    uint16_t    SpanRecip;                          // 1/(Trip - Derate)   (x 2^24)
+    } Therm NOINIT;
+
+//
+// Setup waiting to be switched in, and whether the setpoints have slewed to it yet.
+//   The setups live in the EEPROM copy in RAM, so just point to it.
+//
+static struct {
+    TRANSDUCER_SET *Set;                            // Setup to switch to
+    bool            Ready;                          // TRUE when OK to put it in
+    } Switch NOINIT;
+
+//
+// Resonance acquisition state, for the search at turn on
+//
+static struct {
+    uint16_t    Freq;                               // Frequency being measured
+    uint16_t    Hi;                                 // End of this sweep
+    uint16_t    Step;                               // Step for this sweep
+    uint16_t    BestFreq;                           // Best frequency this sweep
+    uint16_t    BestCurrent;                        //   and the current there
+    uint8_t     Settle;                             // Frames until measurement
+    } Acquire NOINIT;
+
+//
+// Thermal drift state
+//
+static struct {
+    uint32_t    Frames;                             // Control frames since turn on
+    } Drift NOINIT;
+
+//
+// Drift model fitting state, sampled once a second
+//
+static struct {
+    bool        Run;                                // TRUE while collecting
+    uint8_t     Ticks;                              // UI ticks to next sample
+    uint16_t    Samples;                            // Samples collected
+    uint16_t    Secs0;                              // On time     at first sample
+    uint32_t    Joules0;                            // Energy      at first sample
+    uint16_t    Freq0;                              // Resonance   at first sample
+    int64_t     SumEE;                              // Sum of energy squared
+    int64_t     SumER;                              // Sum of energy x freq residual
+    } DriftFit NOINIT;
+
+//
+// Load classifier state
+//
+static struct {
+    uint32_t    Filter;                             // Signature x 2^LOAD_FILTER_SHIFT
+    bool        Primed;                             // TRUE once Filter has a value
+    TRANSDUCER_LOAD Pending;                        // State waiting to be confirmed
+    uint8_t     Confirm;                            //   and frames it has held
+    TRANSDUCER_LOAD CalRef;                         // Reference being calibrated
+    uint16_t    CalFrames;                          // Frames left to calibrate
+    uint32_t    CalSum;                             // Sum of signature so far
+    } Load NOINIT;
+
+//
+// Power regulator state
+//
+static struct {
+    int32_t     Integ;                              // Integrator, wiper counts x 256
+    bool        Run;                                // TRUE once integrator is seeded
+    uint8_t     Settled;                            // Ticks within the deadband
+    uint32_t    Slewed;                             // Current setpoint, slew limited
+                                                    //   (amps x 10 x frames per sec)
+    bool        Saturated;                          // TRUE if output maxed, still short
+    } Regulator NOINIT;
+
+static bool PwrMapDirty NOINIT;                     // TRUE if map needs saving
+
+//
+// Soft start/stop state
+//
+// Pos runs from 0 (off) to RAMP_FULL (full power) in steps of Step per control frame.
+//
+static struct {
+    uint16_t    Pos;                                // Position along the ramp
+    uint16_t    Step;                               // Change in Pos per frame
+    int8_t      Dir;                                // +1 ramping up, -1 down, 0 idle
+    } Ramp NOINIT;
+
+#define RAMP_FULL       0xFFFF
+#define FRAME_MS        (CONTROL_FRAME_TICKS*1000/CONTROL_TICKS_PER_SEC)
+
+//
+// TransducerCurr.Energy is the sum of measured power over each control frame, so is
+//   in units of (watts x 10) x frames. At 100 frames per second, that's millijoules.
+//
+// A 32 bit sum holds a bit over 4 megajoules, well past TRANSDUCER_MAX_DOSE.
+//
+#define ENERGY_PER_JOULE    (10UL*CONTROL_FRAMES_PER_SEC)
+
+//
+// Power is Current x Volts x PWM / 1000000, with current to 10 mA. To avoid the
+//   divide, the product is scaled down by 2^12 along the way to stay in 32 bits,
+//   then multiplied by 2^19 x 2^12 / 1000000 and scaled down by 2^19.
+//
+#define POWER_RECIP     ((2147483648UL + 500000)/1000000)
+
+//
+// Pulsed output state
+//
+static struct {
+    uint16_t    Ticks;                              // Ticks until next pulse edge
+    uint16_t    OnTicks;                            // Pulse on  time, in ticks
+    uint16_t    OffTicks;                           // Pulse off time, in ticks
+    } Pulse NOINIT;
+
+//
+// FM dither state, for CTL_FREQ_MOD
+//
+// Each half cycle of Phase is one straight line from Start to End (Hz from centre).
+//
+static struct {
+    uint16_t    Phase;                              // Position in the sweep cycle
+    uint16_t    Step;                               // Change in Phase per tick
+    int16_t     Start;                              // Offset at start of half cycle
+    int16_t     End;                                // Offset at end   of half cycle
+    uint16_t    Random;                             // Random number generator state
+    } Dither NOINIT;
+
+//
+// Control tick state
+//
+static struct {
+    uint8_t     Ticks;                              // Ticks until end of frame
+    uint8_t     Wiper;                              // Wiper as last sent to the pot
+    bool        Gated;                              // TRUE if output was off in frame
+    } Frame NOINIT;
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TrackReset - Restart resonance tracking from scratch
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void TrackReset(void) {
+
+    memset(&Track,0,sizeof(Track));
+
+    Track.Dir    = 1;
+    Track.Settle = TRACK_SETTLE_FRAMES;
+
+    TransducerCurr.Locked = false;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// LoadReset - Start classifying the load from scratch
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void LoadReset(void) {
+
+    Load.Primed  = false;
+    Load.Pending = LOAD_UNKNOWN;
+    Load.Confirm = 0;
+
+    TransducerCurr.Load    = LOAD_UNKNOWN;
+    TransducerCurr.LoadSig = 0;
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -91,6 +329,7 @@ void TransducerInit(void) {
     SG3525_INIT;
     AD9833Init();
     ACS712Init();
+    ADCInit();
     PWMPotInit;
     PWMInit();
     InputsInit();
@@ -116,9 +355,23 @@ void TransducerInit(void) {
     // TransducerCurr.PWMWiper = 0;
     // TransducerCurr.EStop    = false;
     // TransducerCurr.On       = false;
+    // TransducerCurr.Locked   = false;
     //
     memset(&TransducerCurr,0,sizeof(TransducerCurr));
+    memset(&Regulator     ,0,sizeof(Regulator));
+    memset(&Frame         ,0,sizeof(Frame));
+    memset(&Ramp          ,0,sizeof(Ramp));
+    memset(&Pulse         ,0,sizeof(Pulse));
+    memset(&Load          ,0,sizeof(Load));
+    memset(&Dither        ,0,sizeof(Dither));
+    memset(&Retune        ,0,sizeof(Retune));
+    memset(&DriftFit      ,0,sizeof(DriftFit));
+    memset(&Therm         ,0,sizeof(Therm));
+    memset(&Switch        ,0,sizeof(Switch));
+    PwrMapDirty = false;
 
+    TrackReset();
+    LoadReset();
     TransducerSetup();
     TransducerOn(false);
     TransducerEStop(true);
@@ -127,237 +380,2002 @@ void TransducerInit(void) {
     // The default power wiper aetting was determined experimentally, and
     //   represents a reasonably small initial PWM (24%) as a starting point.
     //
-    TransducerCurr.PWMWiper = 30;
-    PWMPotSetWiper(TransducerCurr.PWMWiper);
+    // Once running, the learned power map takes over (see TransducerOn).
+    //
+    TransducerCurr.PWMWiper = PWR_MAP_SEED_WIPER;
+    PWMPotSetWiper(Frame.Wiper = TransducerCurr.PWMWiper);
+    Frame.Ticks = CONTROL_FRAME_TICKS;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// MapPoint - Find the power map entry at or below a given power
+//
+// Inputs:      Frequency of interest (Hz)
+//              Power     of interest (watts x 10)
+//
+// Outputs:     Address of map entry. The entry above it covers the rest of the interval.
+//
+static uint8_t *MapPoint(uint16_t Freq,uint16_t Power) {
+    uint8_t Band;
+
+    if( Freq < TRANSDUCER_MIN_FREQ )
+        Freq = TRANSDUCER_MIN_FREQ;
+
+    Band = (Freq - TRANSDUCER_MIN_FREQ) >> PWR_MAP_BAND_SHIFT;
+
+    if( Band > PWR_MAP_BANDS-1 )
+        Band = PWR_MAP_BANDS-1;
+
+    return &EEPROM.PwrMap.Wiper[Band][Power >> PWR_MAP_POINT_SHIFT];
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PredictWiper - Predict the wiper setting needed for a given power
+//
+// Inputs:      Frequency of interest (Hz)
+//              Power     of interest (watts x 10)
+//
+// Outputs:     Wiper setting, interpolated from the power map
+//
+static uint8_t PredictWiper(uint16_t Freq,uint16_t Power) {
+
+    if( Power > TRANSDUCER_MAX_POWER )
+        Power = TRANSDUCER_MAX_POWER;
+
+    uint8_t    *Point = MapPoint(Freq,Power);
+    uint8_t     Frac  = Power & ((1 << PWR_MAP_POINT_SHIFT)-1);
+
+    return ((uint16_t) Point[0]*((1 << PWR_MAP_POINT_SHIFT)-Frac) +
+            (uint16_t) Point[1]*Frac +
+            (1 << (PWR_MAP_POINT_SHIFT-1))) >> PWR_MAP_POINT_SHIFT;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// LearnWiper - Update the power map with a known good wiper setting
+//
+// The prediction error is split between the two map entries on either side, weighted
+//   by how close each one is, and only half the error is taken each time so that noise
+//   averages out.
+//
+// Inputs:      Frequency of note (Hz)
+//              Power     of note (watts x 10)
+//              Wiper setting that gave that power
+//
+// Outputs:     None.
+//
+static void LearnWiper(uint16_t Freq,uint16_t Power,uint8_t Wiper) {
+
+    if( Power > TRANSDUCER_MAX_POWER )
+        return;
+
+    int16_t     Error = (int16_t) Wiper - PredictWiper(Freq,Power);
+
+    if( Error < PWR_MAP_MIN_ERROR && Error > -PWR_MAP_MIN_ERROR )
+        return;
+
+    uint8_t    *Point = MapPoint(Freq,Power);
+    uint8_t     Frac  = Power & ((1 << PWR_MAP_POINT_SHIFT)-1);
+    int16_t     Lo    = Point[0] + Error*((1 << PWR_MAP_POINT_SHIFT)-Frac)/(2 << PWR_MAP_POINT_SHIFT);
+    int16_t     Hi    = Point[1] + Error*Frac                             /(2 << PWR_MAP_POINT_SHIFT);
+
+    if( Lo < 0 ) Lo = 0;
+    if( Hi < 0 ) Hi = 0;
+    if( Lo > PWMPot_MAX_WIPER ) Lo = PWMPot_MAX_WIPER;
+    if( Hi > PWMPot_MAX_WIPER ) Hi = PWMPot_MAX_WIPER;
+
+    if( Point[0] != Lo || Point[1] != Hi ) {
+        Point[0] = Lo;
+        Point[1] = Hi;
+        PwrMapDirty = true;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerResetMap - Forget the learned power map
+//
+// An unlearned map is a straight line from PWR_MAP_SEED_WIPER at zero power to full
+//   wiper at full power, the same in every band.
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Only changes the RAM copy. The EEPROM is updated the next time the transducer
+//         is off.
+//
+void TransducerResetMap(void) {
+
+    for( uint8_t Band = 0; Band < PWR_MAP_BANDS; Band++ ) {
+        for( uint8_t Point = 0; Point < PWR_MAP_POINTS; Point++ )
+            EEPROM.PwrMap.Wiper[Band][Point] = PWR_MAP_SEED_WIPER +
+                (uint16_t) Point*(PWMPot_MAX_WIPER-PWR_MAP_SEED_WIPER)/(PWR_MAP_POINTS-1);
+        }
+
+    PwrMapDirty = true;
     }
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerEStop - Set/clear EStop
+// RampScale - Return the fraction of full power the ramp allows right now
 //
-// Inputs:      TRUE  if     in EStop, output is stopped
-//              FALSE if not in EStop, clear to operate transducer
+// Inputs:      None.
+//
+// Outputs:     Scale factor, 0 to 256 (== full power)
+//
+static uint16_t RampScale(void) {
+
+    if( Ramp.Pos == RAMP_FULL )
+        return 256;
+
+    uint16_t    x = Ramp.Pos >> 8;
+
+    //
+    // S-curve is the "smoothstep" polynomial 3x^2 - 2x^3, which starts and ends with
+    //   zero slope. With x in 256ths, that's x*x*(3*256 - 2x)/65536.
+    //
+    if( TransducerSet.RampMode == RAMP_SCURVE )
+        return ((uint32_t) x*x*(3*256 - 2*x)) >> 16;
+
+    return x;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// StartPower - Power to predict the starting wiper from
+//
+// Inputs:      None.
+//
+// Outputs:     Power expected at the start of regulation (watts x 10)
+//
+// In constant current mode that's only an estimate, and if the setpoint is slew
+//   limited it starts from nothing anyway.
+//
+static uint16_t StartPower(void) {
+    uint16_t    Power = TransducerSet.Power;
+
+    if( TransducerSet.CtlMode == CTL_CONST_CURRENT ) {
+        if( TransducerSet.CurrentSlew ) Power = 0;
+        else                            Power = TransducerSet.Current*CURRENT_GAIN_SCALE;
+        }
+
+    return ((uint32_t) Power*RampScale()) >> 8;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// StopOutput - Turn the output off, right now
+//
+// Inputs:      None.
 //
 // Outputs:     None.
 //
-void TransducerEStop(bool EStop) {
-
-    TransducerCurr.EStop = EStop;
-
-    //
-    // If EStop, turn off transducer
-    //
-    if( TransducerCurr.EStop )
-        TransducerOn(false);
+static void StopOutput(void) {
+
+    TransducerCurr.RunTimer  = 0;
+    TransducerCurr.On        = false;
+    TransducerCurr.Acquiring = false;
+    SG3525_OFF;
+    TrackReset();
+
+    Ramp.Pos = 0;
+    Ramp.Dir = 0;
     }
 
-
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RampStart - Start the soft start/stop ramp moving
+//
+// Inputs:      Direction to go (+1 == up, -1 == down)
+//
+// Outputs:     None.
+//
+static void RampStart(int8_t Dir) {
+
+    if( TransducerSet.RampTime <= FRAME_MS ) Ramp.Step = RAMP_FULL;
+    else Ramp.Step = ((uint32_t) RAMP_FULL*FRAME_MS)/TransducerSet.RampTime;
+
+    Ramp.Dir = Dir;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RampUpdate - Move the soft start/stop ramp along
+//
+// Inputs:      None. Called each control frame
+//
+// Outputs:     None.
+//
+static void RampUpdate(void) {
+
+    if( Ramp.Dir > 0 ) {
+        if( Ramp.Pos >= RAMP_FULL - Ramp.Step ) {
+            Ramp.Pos = RAMP_FULL;
+            Ramp.Dir = 0;
+            }
+        else Ramp.Pos += Ramp.Step;
+        }
+
+    //
+    // Once we've ramped down to nothing, the output actually turns off
+    //
+    else if( Ramp.Dir < 0 ) {
+        if( Ramp.Pos <= Ramp.Step ) StopOutput();
+        else                        Ramp.Pos -= Ramp.Step;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// MSToTicks - Convert milliseconds to control ticks
+//
+// Inputs:      Time in ms
+//
+// Outputs:     Number of control ticks, at least 1
+//
+static uint16_t MSToTicks(uint16_t MS) {
+    uint32_t Ticks = ((uint32_t) MS*CONTROL_TICKS_PER_SEC + 500)/1000;
+
+    if( Ticks == 0      ) return 1;
+    if( Ticks > 0xFFFF  ) return 0xFFFF;
+    return Ticks;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PulseStart - Start a new pulse train, beginning with an on pulse
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void PulseStart(void) {
+
+    Pulse.OnTicks  = MSToTicks(TransducerSet.PulseOn);
+    Pulse.OffTicks = MSToTicks(TransducerSet.PulseOff);
+    Pulse.Ticks    = Pulse.OnTicks;
+    TransducerCurr.Pulses = TransducerSet.PulseCount;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// AcquireSweep - Start a resonance search sweep
+//
+// Inputs:      Lowest  frequency to measure
+//              Highest frequency to measure
+//              Step between measurements
+//
+// Outputs:     None.
+//
+static void AcquireSweep(uint16_t Lo,uint16_t Hi,uint16_t Step) {
+
+    if( Lo < TRANSDUCER_MIN_FREQ ) Lo = TRANSDUCER_MIN_FREQ;
+    if( Hi > TRANSDUCER_MAX_FREQ ) Hi = TRANSDUCER_MAX_FREQ;
+
+    Acquire.Freq        = Lo;
+    Acquire.Hi          = Hi;
+    Acquire.Step        = Step;
+    Acquire.BestCurrent = 0;
+    Acquire.Settle      = ACQ_SETTLE_FRAMES;
+
+    //
+    // Set the frequency directly, since we're called with the control tick held off
+    //
+    TransducerSet.Freq  = Lo;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// AcquireStart - Start the resonance search
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// The search runs at a fixed, low drive level so that current alone tells us how
+//   close we are to resonance. The power loop and soft start ramp wait until it's done.
+//
+static void AcquireStart(void) {
+    uint16_t    Power = TransducerSet.Power;
+
+    if( Power > ACQ_POWER )
+        Power = ACQ_POWER;
+
+    Acquire.BestFreq = TransducerSet.Freq;
+    AcquireSweep(TRANSDUCER_MIN_FREQ,TRANSDUCER_MAX_FREQ,ACQ_COARSE_STEP);
+
+    TransducerCurr.PWMWiper  = PredictWiper(TransducerSet.Freq,Power);
+    TransducerCurr.Acquiring = true;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PulseUpdate - Gate the output on and off, for RUN_PULSED mode
+//
+// Inputs:      None. Called each control tick
+//
+// Outputs:     None.
+//
+static void PulseUpdate(void) {
+
+    if( --Pulse.Ticks > 0 )
+        return;
+
+    if( SG3525_IS_ON ) {
+        //
+        // End of a pulse. If that was the last one, we're done.
+        //
+        if( TransducerCurr.Pulses && --TransducerCurr.Pulses == 0 ) {
+            StopOutput();
+            return;
+            }
+
+        SG3525_OFF;
+        Pulse.Ticks = Pulse.OffTicks;
+        }
+    else {
+        SG3525_ON;
+        Pulse.Ticks = Pulse.OnTicks;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// DitherUpdate - Move the FM dither sweep along
+//
+// Inputs:      None. Called each control tick
+//
+// Outputs:     Offset from centre frequency (Hz)
+//
+static int16_t DitherUpdate(void) {
+    uint16_t    Phase = Dither.Phase + Dither.Step;
+
+    //
+    // New half cycle. A triangle just turns around, random picks a new end point
+    //   anywhere within the deviation.
+    //
+    if( (Phase ^ Dither.Phase) & 0x8000 ) {
+        Dither.Start = Dither.End;
+
+        if( TransducerSet.DitherWave == DITHER_RANDOM ) {
+            //
+            // 16 bit Galois LFSR, x^16 + x^14 + x^13 + x^11 + 1
+            //
+            Dither.Random = (Dither.Random >> 1) ^ (-(Dither.Random & 1) & 0xB400);
+            Dither.End    = (((uint32_t) Dither.Random*(2*TransducerSet.DitherDev + 1)) >> 16) -
+                            TransducerSet.DitherDev;
+            }
+        else Dither.End = -Dither.Start;
+        }
+
+    Dither.Phase = Phase;
+
+    return Dither.Start +
+        (((int32_t) (Dither.End - Dither.Start)*(Phase & 0x7FFF)) >> 15);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerEStop - Set/clear EStop
+//
+// Inputs:      TRUE  if     in EStop, output is stopped
+//              FALSE if not in EStop, clear to operate transducer
+//
+// Outputs:     None.
+//
+void TransducerEStop(bool EStop) {
+
+    //
+    // Clearing EStop also clears any overcurrent trip that caused it, and any other
+    //   latched faults
+    //
+    if( !EStop ) {
+        DISABLE_CONTROL;
+        ACS712ClearTrip();
+        FaultReset();
+        TransducerCurr.Tripped = false;
+        ENABLE_CONTROL;
+        }
+
+    TransducerCurr.EStop = EStop;
+
+    //
+    // If EStop, turn off transducer
+    //
+    if( TransducerCurr.EStop )
+        TransducerOn(false);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// SetOutput - Enable/Disable transducer output
+//
+// Inputs:      TRUE  if output is ON
+//              FALSE otherwise
+//              TRUE  if turning on starts a new run
+//              FALSE to carry on the run that a fault stopped
+//
+// Outputs:     None.
+//
+static void SetOutput(bool On,bool NewRun) {
+
+    //
+    // Off is a safe point for a setup switch, so finish any that's left over before
+    //   starting again.
+    //
+    if( On && TransducerCurr.Switching && !TransducerCurr.On )
+        TransducerSwitch(Switch.Set);
+
+    //
+    // The output mustn't come on while the AtoD is off on the 1.1V reference, or
+    //   still settling back from it, since the overcurrent trip can't see anything.
+    //
+    if( On )
+        ADCHold(true);
+
+    //
+    // Keep the control tick out while we change state. Switching the output by hand
+    //   overrides any fault retry.
+    //
+    DISABLE_CONTROL;
+
+    FaultCancelRetry();
+
+    if( !On ) {
+
+        //
+        // Soft stop if we can, otherwise stop right now. The control tick will turn
+        //   off the output at the end of the ramp.
+        //
+        if( TransducerCurr.On              &&
+            !TransducerCurr.EStop          &&
+            TransducerSet.RampMode != RAMP_NONE ) {
+            TransducerCurr.RunTimer  = 0;
+            TransducerCurr.Acquiring = false;
+            RampStart(-1);
+            }
+        else StopOutput();
+        }
+
+    //
+    // Don't allow turn ON in EStop
+    //
+    else if( !TransducerCurr.EStop && !ACS712Tripped() && !TransducerCurr.UnderVolt &&
+             !TransducerCurr.Hot   && !FaultLatched() ) {
+
+        //
+        // Set the run timer if needed
+        //
+        if( TransducerSet.RunMode == RUN_TIMED )
+            TransducerCurr.RunTimer = TransducerSet.RunTimer;
+
+        //
+        // Start the pulse train with the first pulse, unless we're already running
+        //
+        if( TransducerSet.RunMode == RUN_PULSED && !TransducerCurr.On )
+            PulseStart();
+
+        //
+        // Each new run counts energy and drift from zero, and starts back at the
+        //   set frequency. A fault retry keeps the energy, so an energy dose picks up
+        //   where it was stopped.
+        //
+        if( !TransducerCurr.On ) {
+            if( NewRun )
+                TransducerCurr.Energy = 0;
+            TransducerCurr.Drift  = 0;
+            TransducerCurr.Retune = 0;
+            Drift.Frames          = 0;
+            memset(&Retune,0,sizeof(Retune));
+            LoadReset();
+            }
+
+        //
+        // Start the ramp up, from wherever it is now. If we were in the middle of a
+        //   soft stop, this just turns it around.
+        //
+        if( TransducerSet.RampMode == RAMP_NONE ) {
+            Ramp.Pos = RAMP_FULL;
+            Ramp.Dir = 0;
+            }
+        else if( Ramp.Pos != RAMP_FULL )
+            RampStart(1);
+
+        //
+        // Jump straight to the wiper setting that gave this power last time (or zero
+        //   power, if ramping), and let the regulator take it from there.
+        //
+#ifndef USE_WIPER_CMDS
+        if( !TransducerCurr.On ) {
+            TransducerCurr.PWMWiper = PredictWiper(TransducerSet.Freq,StartPower());
+            Regulator.Run = false;
+
+            if( TransducerSet.Acquire )
+                AcquireStart();
+            }
+#endif
+
+        //
+        // Don't upset a pulse train that's already running
+        //
+        if( !TransducerCurr.On || TransducerSet.RunMode != RUN_PULSED )
+            SG3525_ON;
+
+        TransducerCurr.On = true;
+        }
+
+    ENABLE_CONTROL;
+
+    ADCHold(false);
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerOn    - Enable/Disable transducer output
+// TransducerRetry - Turn the output back on after a fault, continuing the same run
+//
+// Inputs:      TRUE  if output is ON
+//              FALSE otherwise
+//
+// Outputs:     None.
+//
+void TransducerOn(bool On) { SetOutput(On,true);  }
+void TransducerRetry(void) { SetOutput(true,false); }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRunMode - Set transducer run mode
+//
+// Inputs:      Run mode (RUN_CONTINUOUS/RUN_TIMED
+//              Ticks to run (in 1/25ths of a second)
+//
+// Outputs:     None.
+//
+//
+void TransducerRunMode(TRANSDUCER_RUN_MODE RunMode,uint16_t Ticks) {
+
+    DISABLE_CONTROL;
+
+    //
+    // If we're running, switch over to the new mode now. Pulses start with an on
+    //   pulse, and leaving pulsed mode leaves the output on.
+    //
+    if( TransducerCurr.On && RunMode != TransducerSet.RunMode ) {
+        if( RunMode == RUN_TIMED )
+            TransducerCurr.RunTimer = Ticks;
+
+        if( TransducerSet.RunMode == RUN_PULSED )
+            SG3525_ON;
+
+        if( RunMode == RUN_PULSED )
+            PulseStart();
+        }
+
+    TransducerSet.RunMode  = RunMode;
+    TransducerSet.RunTimer = Ticks;
+
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerPulse - Set pulse timing, for RUN_PULSED mode
+//
+// Inputs:      On  time of each pulse (ms)
+//              Off time between pulses (ms)
+//              Number of pulses to run (0 == until turned off)
+//
+// Outputs:     None.
+//
+// NOTE: Takes effect at the next turn on
+//
+void TransducerPulse(uint16_t OnMS,uint16_t OffMS,uint16_t Count) {
+
+    DISABLE_CONTROL;
+    TransducerSet.PulseOn    = OnMS;
+    TransducerSet.PulseOff   = OffMS;
+    TransducerSet.PulseCount = Count;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDose - Set energy dose, for RUN_ENERGY mode
+//
+// Inputs:      Energy to deliver (joules)
+//
+// Outputs:     None.
+//
+void TransducerDose(uint32_t Joules) {
+
+    DISABLE_CONTROL;
+    TransducerSet.Energy = Joules;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerGetEnergy - Return energy delivered in the current (or last) run
+//
+// Inputs:      None.
+//
+// Outputs:     Energy delivered (joules)
+//
+uint32_t TransducerGetEnergy(void) {
+    uint32_t Energy;
+
+    DISABLE_CONTROL;
+    Energy = TransducerCurr.Energy;
+    ENABLE_CONTROL;
+
+    return Energy/ENERGY_PER_JOULE;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerCtlMode - Set transducer ctl mode
+//
+// Inputs:      Ctl mode (CTL_CONST_FREQ,CTL_MAX_EFF)
+//
+// Outputs:     None.
+//
+//
+void TransducerCtlMode(TRANSDUCER_CTL_MODE CtlMode) {
+
+    DISABLE_CONTROL;
+    TransducerSet.CtlMode  = CtlMode;
+    TrackReset();
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDither - Set FM dither, for CTL_FREQ_MOD mode
+//
+// Inputs:      Deviation either side of TransducerSet.Freq (Hz)
+//              Sweep rate, full cycles per second (Hz)
+//              Sweep shape (DITHER_TRIANGLE,DITHER_RANDOM)
+//
+// Outputs:     None.
+//
+void TransducerDither(uint16_t Dev,uint8_t Rate,TRANSDUCER_DITHER_WAVE Wave) {
+
+    DISABLE_CONTROL;
+    TransducerSet.DitherDev  = Dev;
+    TransducerSet.DitherRate = Rate;
+    TransducerSet.DitherWave = Wave;
+
+    //
+    // One full cycle of Phase is one sweep up and back
+    //
+    Dither.Step  = ((uint32_t) Rate << 16)/CONTROL_TICKS_PER_SEC;
+    Dither.Phase = 0;
+    Dither.Start = -Dev;
+    Dither.End   =  Dev;
+
+    if( Dither.Random == 0 )
+        Dither.Random = 0xACE1;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerAcquire - Enable/disable resonance search at turn on
+//
+// Inputs:      TRUE to search for resonance at turn on
+//
+// Outputs:     None.
+//
+//
+void TransducerAcquire(bool Acquire) {
+
+    TransducerSet.Acquire = Acquire;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDrift - Set thermal drift model
+//
+// Inputs:      Freq drift per sec of on time (mHz)
+//              Freq drift per kJ delivered   (mHz)
+//              Limit on drift correction (Hz, 0 == no correction)
+//
+// Outputs:     None.
+//
+void TransducerDrift(int16_t PerSec,int16_t PerKJ,uint8_t Max) {
+
+    DISABLE_CONTROL;
+    TransducerSet.DriftTime   = PerSec;
+    TransducerSet.DriftEnergy = PerKJ;
+    TransducerSet.DriftMax    = Max;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerThermal - Set stack thermal model
+//
+// Inputs:      Rated current (amps x 10, 0 == no model)
+//              Heating time constant (secs, at least 1)
+//              Cooling time constant (secs, at least 1)
+//              Heat to start derating at (% of rated)
+//              Heat to trip at (% of rated, more than the derate level)
+//
+// Outputs:     None.
+//
+void TransducerThermal(uint8_t Rated,uint16_t Heat,uint16_t Cool,uint8_t Derate,uint8_t Trip) {
+
+    if( Heat == 0 ) Heat = 1;
+    if( Cool == 0 ) Cool = 1;
+    if( Trip <= Derate )
+        Trip = Derate + 1;
+
+    DISABLE_CONTROL;
+    TransducerSet.ThermRated  = Rated;
+    TransducerSet.ThermHeat   = Heat;
+    TransducerSet.ThermCool   = Cool;
+    TransducerSet.ThermDerate = Derate;
+    TransducerSet.ThermTrip   = Trip;
+
+    Therm.RecipRated = Rated ? 65536UL/Rated : 0;
+    Therm.KHeat      = (1UL << 24)/((uint32_t) Heat*CONTROL_FRAMES_PER_SEC);
+    Therm.KCool      = (1UL << 24)/((uint32_t) Cool*CONTROL_FRAMES_PER_SEC);
+    Therm.Derate     = ((uint32_t) Derate << 16)/100;
+    Therm.Trip       = ((uint32_t) Trip   << 16)/100;
+    Therm.SpanRecip  = (1UL << 24)/(Therm.Trip - Therm.Derate);
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerLoad - Set load classifier policy and references
+//
+// Inputs:      What to do when dry or overloaded (LOAD_FLAG,LOAD_DERATE,LOAD_STOP)
+//              Load signature running dry  (0 == uncalibrated)
+//              Load signature under normal load
+//
+// Outputs:     None.
+//
+void TransducerLoad(TRANSDUCER_LOAD_POLICY Policy,uint16_t Dry,uint16_t Normal) {
+
+    DISABLE_CONTROL;
+    TransducerSet.LoadPolicy = Policy;
+    TransducerSet.LoadDry    = Dry;
+    TransducerSet.LoadNormal = Normal;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerLoadCal - Calibrate the load classifier
+//
+// Inputs:      LOAD_DRY     to measure the dry reference
+//              LOAD_OK      to measure the normal load reference
+//              LOAD_UNKNOWN to forget the calibration
+//
+// Outputs:     None.
+//
+void TransducerLoadCal(TRANSDUCER_LOAD Ref) {
+
+    DISABLE_CONTROL;
+
+    if( Ref == LOAD_DRY || Ref == LOAD_OK ) {
+        Load.CalRef    = Ref;
+        Load.CalFrames = LOAD_CAL_FRAMES;
+        Load.CalSum    = 0;
+        TransducerCurr.LoadCal = true;
+        }
+    else {
+        TransducerSet.LoadDry    = 0;
+        TransducerSet.LoadNormal = 0;
+        Load.CalFrames           = 0;
+        TransducerCurr.LoadCal   = false;
+        LoadReset();
+        }
+
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerTrackStep - Set resonance tracking step
+//
+// Inputs:      Frequency step used by CTL_MAX_EFF tracking (Hz)
+//
+// Outputs:     None.
+//
+//
+void TransducerTrackStep(uint8_t TrackStep) {
+
+    TransducerSet.TrackStep = TrackStep;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRetune - Set limit on headroom retune
+//
+// Inputs:      Furthest to move the frequency when power limited (Hz, 0 == off)
+//
+// Outputs:     None.
+//
+// NOTE: Turning it off puts the frequency straight back
+//
+void TransducerRetune(uint8_t RetuneMax) {
+
+    DISABLE_CONTROL;
+    TransducerSet.RetuneMax = RetuneMax;
+    if( RetuneMax == 0 )
+        TransducerCurr.Retune = 0;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRamp - Set soft start/stop profile
+//
+// Inputs:      Ramp mode (RAMP_NONE,RAMP_LINEAR,RAMP_SCURVE)
+//              Time to ramp between zero and full power (ms)
+//
+// Outputs:     None.
+//
+// NOTE: Takes effect at the next turn on or off
+//
+void TransducerRamp(TRANSDUCER_RAMP_MODE RampMode,uint16_t RampTime) {
+
+    DISABLE_CONTROL;
+    TransducerSet.RampMode = RampMode;
+    TransducerSet.RampTime = RampTime;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerFreq - Set transducer output frequency
+//
+// Inputs:      Frequency to set (Hz)
+//
+// Outputs:     None.
+//
+// NOTE: The AD9833 is updated at the next control tick
+//
+void TransducerFreq(uint16_t Freq) {
+
+    DISABLE_CONTROL;
+    TransducerSet.Freq = Freq;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerPower - Set transducer output power
+//
+// Inputs:      Power to set, in watts*10 (ie: 315 means 31.5 watts)
+//
+// Outputs:     None.
+//
+//
+void TransducerPower(uint16_t Power) {
+
+    DISABLE_CONTROL;
+    TransducerSet.Power = Power;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerCurrent - Set transducer output current, for CTL_CONST_CURRENT mode
+//
+// Inputs:      Current to set, in amps*10 (ie: 15 means 1.5 amps)
+//              Slew limit on the setpoint, in amps*10 per second (0 == none)
+//
+// Outputs:     None.
+//
+void TransducerCurrent(uint16_t Current,uint16_t Slew) {
+
+    DISABLE_CONTROL;
+    TransducerSet.Current     = Current;
+    TransducerSet.CurrentSlew = Slew;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerPwrGains - Set power regulator gains
+//
+// Inputs:      Proportional gain (1/256ths of a wiper count per watt x 10)
+//              Integral     gain (1/256ths of a wiper count per watt x 10 per tick)
+//              Deadband          (watts x 10)
+//
+// Outputs:     None.
+//
+//
+void TransducerPwrGains(uint8_t Kp,uint8_t Ki,uint8_t Deadband) {
+
+    DISABLE_CONTROL;
+    TransducerSet.PwrKp = Kp;
+    TransducerSet.PwrKi = Ki;
+    TransducerSet.PwrDB = Deadband;
+    ENABLE_CONTROL;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// SlewCurrent - Move the current setpoint towards TransducerSet.Current
+//
+// Inputs:      None. Called each control frame, in CTL_CONST_CURRENT mode
+//
+// Outputs:     Current setpoint for this frame (amps x 10)
+//
+static uint16_t SlewCurrent(void) {
+    uint32_t    Goal = (uint32_t) TransducerSet.Current*CONTROL_FRAMES_PER_SEC;
+    uint16_t    Slew = TransducerSet.CurrentSlew;
+
+    if     ( Slew == 0                       ) Regulator.Slewed  = Goal;
+    else if( Regulator.Slewed + Slew < Goal  ) Regulator.Slewed += Slew;
+    else if( Regulator.Slewed > Goal + Slew  ) Regulator.Slewed -= Slew;
+    else                                       Regulator.Slewed  = Goal;
+
+    return Regulator.Slewed/CONTROL_FRAMES_PER_SEC;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RegulatePower - Station keeping for power setpoint
+//
+// The setpoint is TransducerSet.Power, scaled down by the soft start/stop ramp. In
+//   constant current mode it's the slew limited TransducerSet.Current instead, and
+//   the current is regulated rather than the power.
+//
+// A fixed point PI regulator on the PWM wiper. The integrator is kept in 1/256ths of a
+//   wiper count, and the output is the integrator plus the proportional term.
+//
+// Errors within the deadband are treated as zero, so the wiper holds still instead of
+//   chattering one count either side of the setpoint.
+//
+// For anti-windup, the integrator is frozen whenever the output is pinned at a limit
+//   and the error would push it further. The PWM limit counts as a limit: once the
+//   SG3525 is at maximum duty, raising the wiper has no effect.
+//
+// Inputs:      None. Called each control frame
+//
+// Outputs:     None.
+//
+static void RegulatePower(void) {
+
+    //
+    // If we're not actually on, then adjusting power will have no effect. Next time
+    //   we turn on, start integrating from wherever the wiper happens to be.
+    //
+    if( !TransducerCurr.On ) {
+        Regulator.Run       = false;
+        Regulator.Settled   = 0;
+        Regulator.Saturated = false;
+        return;
+        }
+
+    if( !Regulator.Run ) {
+        Regulator.Integ  = (int32_t) TransducerCurr.PWMWiper << 8;
+        Regulator.Slewed = (uint32_t) TransducerCurr.Current*CONTROL_FRAMES_PER_SEC;
+        Regulator.Run    = true;
+        }
+
+    uint16_t    Target   = TransducerSet.Power;
+    uint16_t    Measured = TransducerCurr.Power;
+    uint8_t     Scale    = 1;
+
+    if( TransducerSet.CtlMode == CTL_CONST_CURRENT ) {
+        Target   = SlewCurrent();
+        Measured = TransducerCurr.Current;
+        Scale    = CURRENT_GAIN_SCALE;
+        }
+
+    Target = ((uint32_t) Target*RampScale()) >> 8;
+    Target = ((uint32_t) Target*TransducerCurr.HeatScale) >> 8;
+
+    if( TransducerSet.LoadPolicy == LOAD_DERATE &&
+        (TransducerCurr.Load == LOAD_DRY || TransducerCurr.Load == LOAD_OVER) )
+        Target = ((uint32_t) Target*LOAD_DERATE_PCT)/100;
+
+    int16_t     Error  = ((int16_t) Target - (int16_t) Measured)*Scale;
+
+    if( Error <=  (int16_t) TransducerSet.PwrDB &&
+        Error >= -(int16_t) TransducerSet.PwrDB )
+        Error = 0;
+
+    //
+    // Once we've held the setpoint for a while, remember what it took
+    //
+    if( Error != 0 )
+        Regulator.Settled = 0;
+    else if( Regulator.Settled < PWR_MAP_SETTLE_FRAMES )
+        Regulator.Settled++;
+    else if( TransducerCurr.PWM <= PWR_MAX_PWM )
+        LearnWiper(TransducerSet.Freq,TransducerCurr.Power,TransducerCurr.PWMWiper);
+
+    int32_t     Integ = Regulator.Integ + (int32_t) TransducerSet.PwrKi*Error;
+    int32_t     Out   = Integ           + (int32_t) TransducerSet.PwrKp*Error;
+    bool        Limit = false;
+
+    if( Out < 0 ) {
+        Out   = 0;
+        Limit = (Error < 0);
+        }
+
+    if( Out > ((int32_t) PWMPot_MAX_WIPER << 8) ) {
+        Out   = (int32_t) PWMPot_MAX_WIPER << 8;
+        Limit = (Error > 0);
+        }
+
+    //
+    // Note that by design, the SG3525 controller only goes to 98% PWM
+    //   due to dead time.
+    //
+    if( Error > 0 && TransducerCurr.PWM > PWR_MAX_PWM ) {
+        if( Out > ((int32_t) TransducerCurr.PWMWiper << 8) )
+            Out = (int32_t) TransducerCurr.PWMWiper << 8;
+        Limit = true;
+        }
+
+    Regulator.Saturated = Limit && Error > 0;
+
+    if( !Limit ) {
+        if( Integ < 0 )                                 Integ = 0;
+        if( Integ > ((int32_t) PWMPot_MAX_WIPER << 8) ) Integ = (int32_t) PWMPot_MAX_WIPER << 8;
+        Regulator.Integ = Integ;
+        }
+
+    uint16_t    Wiper = (Out + 128) >> 8;
+
+    if( Wiper > PWMPot_MAX_WIPER )
+        Wiper = PWMPot_MAX_WIPER;
+
+    TransducerCurr.PWMWiper = Wiper;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TrackResonance - Station keeping for maximum efficiency
+//
+// A perturb-and-observe hill climber: step the frequency, wait for things to settle,
+//   and keep going in the same direction while the efficiency improves. When it gets
+//   worse we've passed the peak, so turn around.
+//
+// Since our power is calculated as current x volts x PWM, "power per amp" is just the
+//   drive level. What actually peaks at resonance is the power delivered per unit of
+//   drive, which is current per unit of PWM. The power loop may be changing the PWM at
+//   the same time, so compare current/PWM ratios (cross multiplied, to avoid a divide).
+//
+// Inputs:      None. Called each control frame
+//
+// Outputs:     None.
+//
+static void TrackResonance(void) {
+
+    //
+    // If we're not actually on, there's nothing to measure.
+    //
+    if( !TransducerCurr.On || TransducerCurr.PWM == 0 ) {
+        TrackReset();
+        return;
+        }
+
+    if( Track.Settle ) {
+        Track.Settle--;
+        return;
+        }
+
+    //
+    // Compare against the previous step. The very first measurement has nothing to
+    //   compare to, so just take a step.
+    //
+    if( Track.PWM != 0 ) {
+        uint32_t    NewEff = (uint32_t) TransducerCurr.Current*Track.PWM;
+        uint32_t    OldEff = (uint32_t) Track.Current*TransducerCurr.PWM;
+
+        if( NewEff < OldEff ) {
+            //
+            // Passed the peak - turn around. Short runs between reversals mean we're
+            //   dithering across the peak, which is what we want.
+            //
+            Track.Dir = -Track.Dir;
+
+            if( Track.Run <= 2 ) {
+                if( Track.Reversals < TRACK_LOCK_COUNT )
+                    Track.Reversals++;
+                }
+            else Track.Reversals = 0;
+
+            Track.Run = 0;
+            }
+        else if( ++Track.Run > 2 )
+            Track.Reversals = 0;
+        }
+
+    TransducerCurr.Locked = (Track.Reversals >= TRACK_LOCK_COUNT);
+
+    Track.Current = TransducerCurr.Current;
+    Track.PWM     = TransducerCurr.PWM;
+
+    //
+    // Take the next step, turning around at the edges of the allowed band.
+    //
+    uint16_t    Freq = TransducerSet.Freq;
+    uint8_t     Step = TransducerSet.TrackStep;
+
+    if( Track.Dir > 0 ) {
+        if( Freq + Step > TRANSDUCER_MAX_FREQ ) { Track.Dir = -1; Freq -= Step; }
+        else                                                      Freq += Step;
+        }
+    else {
+        if( Freq - Step < TRANSDUCER_MIN_FREQ ) { Track.Dir =  1; Freq += Step; }
+        else                                                      Freq -= Step;
+        }
+
+    TransducerFreq(Freq);
+    Track.Settle = TRACK_SETTLE_FRAMES;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RetuneHeadroom - Detect power limiting, and retune for headroom
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// When power limited, hill climb on current per PWM the same way the resonance
+//   tracker does, but as an offset to the set frequency, and only as far as
+//   TransducerSet.RetuneMax. With headroom back, walk the offset back to zero.
+//
+// NOTE: Called each frame, after RegulatePower()
+//
+static void RetuneHeadroom(void) {
+
+    if( !TransducerCurr.On ) {
+        Retune.Limited = 0;
+        TransducerCurr.PowerLimited = false;
+        return;
+        }
+
+    if( !Regulator.Saturated ) {
+        Retune.Limited = 0;
+        if( TransducerCurr.PWM < PWR_HEADROOM_PWM )
+            TransducerCurr.PowerLimited = false;
+        }
+    else if( Retune.Limited < PWR_LIMIT_FRAMES ) Retune.Limited++;
+    else                                        TransducerCurr.PowerLimited = true;
+
+    if( TransducerSet.RetuneMax == 0 || TransducerSet.CtlMode == CTL_MAX_EFF )
+        return;
+
+    if( Retune.Settle ) {
+        Retune.Settle--;
+        return;
+        }
+
+    int16_t Offset = TransducerCurr.Retune;
+    int16_t Step   = TransducerSet.TrackStep;
+    int16_t Max    = TransducerSet.RetuneMax;
+
+    if( TransducerCurr.PowerLimited ) {
+
+        //
+        // Passed the peak - turn around
+        //
+        if( Retune.PWM != 0 &&
+            (uint32_t) TransducerCurr.Current*Retune.PWM <
+            (uint32_t) Retune.Current*TransducerCurr.PWM )
+            Retune.Dir = -Retune.Dir;
+
+        if( Retune.Dir == 0 )
+            Retune.Dir = 1;
+
+        Retune.Current = TransducerCurr.Current;
+        Retune.PWM     = TransducerCurr.PWM;
+
+        Offset += Retune.Dir*Step;
+        if( Offset >  Max ) { Offset =  Max; Retune.Dir = -1; }
+        if( Offset < -Max ) { Offset = -Max; Retune.Dir =  1; }
+        }
+
+    else if( Offset != 0 && TransducerCurr.PWM < PWR_HEADROOM_PWM ) {
+        if     ( Offset >  Step ) Offset -= Step;
+        else if( Offset < -Step ) Offset += Step;
+        else                      Offset  = 0;
+        Retune.PWM = 0;
+        }
+
+    else return;
+
+    TransducerCurr.Retune = Offset;
+    Retune.Settle = TRACK_SETTLE_FRAMES;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// SlewTo - Move a setpoint towards a goal, by no more than a step
+//
+// Inputs:      Setpoint now
+//              Goal
+//              Largest step
+//
+// Outputs:     New setpoint
+//
+static uint16_t SlewTo(uint16_t Now,uint16_t Goal,uint16_t Step) {
+
+    if( Goal > Now ) return Goal - Now > Step ? Now + Step : Goal;
+    else             return Now - Goal > Step ? Now - Step : Goal;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// SwitchUpdate - Slew the setpoints towards a setup being switched in
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// The tracker is held off while this runs, so in max efficiency mode the frequency
+//   only moves if the new setup leaves that mode. When the setpoints get there (or
+//   the output stops) the switch is ready for TransducerUpdate() to finish.
+//
+// NOTE: Called each frame, after the resonance search
+//
+static void SwitchUpdate(void) {
+
+    if( !TransducerCurr.Switching || Switch.Ready )
+        return;
+
+    if( !TransducerCurr.On ) {
+        Switch.Ready = true;
+        return;
+        }
+
+    uint16_t    Freq = Switch.Set->Freq;
+
+    if( TransducerSet.CtlMode == CTL_MAX_EFF && Switch.Set->CtlMode == CTL_MAX_EFF )
+        Freq = TransducerSet.Freq;
+
+    TransducerSet.Freq    = SlewTo(TransducerSet.Freq   ,Freq               ,SWITCH_FREQ_SLEW);
+    TransducerSet.Power   = SlewTo(TransducerSet.Power  ,Switch.Set->Power  ,SWITCH_PWR_SLEW);
+    TransducerSet.Current = SlewTo(TransducerSet.Current,Switch.Set->Current,SWITCH_CURR_SLEW);
+
+    Switch.Ready = TransducerSet.Freq    == Freq                &&
+                   TransducerSet.Power   == Switch.Set->Power   &&
+                   TransducerSet.Current == Switch.Set->Current;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// ThermalUpdate - Run the stack thermal model
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// Each frame moves the heat 1/(time constant in frames) of the way toward the current
+//   squared. The step is tiny with long time constants, so the fraction left over is
+//   carried to the next frame rather than lost.
+//
+// NOTE: Called each frame, whether on or off
+//
+static void ThermalUpdate(void) {
+
+    if( TransducerSet.ThermRated == 0 ) {
+        Therm.Temp               = 0;
+        Therm.Frac               = 0;
+        TransducerCurr.Heat      = 0;
+        TransducerCurr.HeatScale = 256;
+        TransducerCurr.Hot       = false;
+        return;
+        }
+
+    int16_t     Current = TransducerCurr.On ? (int16_t) TransducerCurr.Current : 0;
+    uint32_t    Target  = 0;
+
+    if( Current > 0 ) {
+        uint32_t Ratio = ((uint32_t) Current*Therm.RecipRated) >> 8;
+
+        if( Ratio > THERM_MAX_RATIO )
+            Ratio = THERM_MAX_RATIO;
+
+        Target = Ratio*Ratio;
+        }
+
+    int32_t     Delta = ((int32_t) Target - (int32_t) Therm.Temp) >> 8;
+
+    Therm.Frac += Delta*(int32_t) (Delta > 0 ? Therm.KHeat : Therm.KCool);
+    Therm.Temp += Therm.Frac >> 16;
+    Therm.Frac &= 0xFFFF;
+
+    TransducerCurr.Heat = (Therm.Temp*100 + 32768) >> 16;
+
+    //
+    // Derate between the two levels, and trip at the top
+    //
+    if     ( Therm.Temp <= Therm.Derate ) TransducerCurr.HeatScale = 256;
+    else if( Therm.Temp >= Therm.Trip   ) TransducerCurr.HeatScale = 0;
+    else TransducerCurr.HeatScale = ((Therm.Trip - Therm.Temp)*Therm.SpanRecip) >> 16;
+
+    if( Therm.Temp >= Therm.Trip ) {
+        if( TransducerCurr.On ) {
+            FaultRaise(FAULT_OVER_TEMP);
+            StopOutput();
+            }
+        TransducerCurr.Hot = true;
+        }
+    else if( Therm.Temp < Therm.Derate )
+        TransducerCurr.Hot = false;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// DriftTerm - One term of the drift model
+//
+// Inputs:      Coefficient (mHz per unit)
+//              Units (secs or kJ/100), already limited to 16 bits
+//              Divisor to get to mHz
+//              Limit on result (mHz)
+//
+// Outputs:     Drift, limited to +/- Limit (mHz)
+//
+static int32_t DriftTerm(int16_t Coeff,uint16_t Units,uint8_t Divisor,int32_t Limit) {
+    int32_t Term = ((int32_t) Coeff*Units)/Divisor;
+
+    if( Term >  Limit ) return  Limit;
+    if( Term < -Limit ) return -Limit;
+    return Term;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// DriftUpdate - Update the thermal drift correction
+//
+// Inputs:      None. Called each control frame
+//
+// Outputs:     None.
+//
+// Drift is slow, so the correction is only recalculated once a second.
+//
+static void DriftUpdate(void) {
+
+    if( !TransducerCurr.On || ++Drift.Frames % CONTROL_FRAMES_PER_SEC )
+        return;
+
+    uint32_t Secs   = Drift.Frames/CONTROL_FRAMES_PER_SEC;
+    uint32_t J10    = TransducerCurr.Energy/(10*ENERGY_PER_JOULE);
+    int32_t  Limit  = (int32_t) TransducerSet.DriftMax*1000;
+
+    if( Secs > 0xFFFF ) Secs = 0xFFFF;
+    if( J10  > 0xFFFF ) J10  = 0xFFFF;
+
+    int32_t  Offset = DriftTerm(TransducerSet.DriftTime  ,Secs,  1,Limit) +
+                      DriftTerm(TransducerSet.DriftEnergy,J10 ,100,Limit);
+
+    if( Offset >  Limit ) Offset =  Limit;
+    if( Offset < -Limit ) Offset = -Limit;
+
+    TransducerCurr.Drift = Offset/1000;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// DriftSample - Collect data for fitting the drift model
+//
+// Inputs:      None. Called each UI tick
+//
+// Outputs:     None.
+//
+static void DriftSample(void) {
+
+    if( !DriftFit.Run || ++DriftFit.Ticks < TICKS_PER_SEC )
+        return;
+
+    DriftFit.Ticks = 0;
+
+    if( !TransducerCurr.On                  ||
+        TransducerSet.CtlMode != CTL_MAX_EFF ||
+        !TransducerCurr.Locked )
+        return;
+
+    DISABLE_CONTROL;
+    uint16_t Secs = Drift.Frames/CONTROL_FRAMES_PER_SEC;
+    uint16_t Freq = TransducerSet.Freq;
+    ENABLE_CONTROL;
+
+    uint32_t Joules = TransducerGetEnergy();
+
+    if( DriftFit.Samples++ == 0 ) {
+        DriftFit.Secs0   = Secs;
+        DriftFit.Joules0 = Joules;
+        DriftFit.Freq0   = Freq;
+        return;
+        }
+
+    //
+    // Least squares, through the first sample, of the residual after the on time
+    //   term: DriftEnergy = 1000 x Sum(E x R)/Sum(E x E), with E in joules and R in mHz
+    //
+    int32_t  E = Joules - DriftFit.Joules0;
+    int32_t  R = ((int32_t) Freq - DriftFit.Freq0)*1000 -
+                 (int32_t) TransducerSet.DriftTime*(Secs - DriftFit.Secs0);
+
+    DriftFit.SumEE += (int64_t) E*E;
+    DriftFit.SumER += (int64_t) E*R;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDriftFit - Fit the thermal drift model from a tracked run
+//
+// Inputs:      TRUE  to start collecting data
+//              FALSE to stop, and fit the model
+//
+// Outputs:     Number of samples collected
+//
+uint16_t TransducerDriftFit(bool Run) {
+
+    if( Run ) {
+        memset(&DriftFit,0,sizeof(DriftFit));
+        DriftFit.Run = true;
+        return 0;
+        }
+
+    if( DriftFit.Run && DriftFit.Samples >= DRIFT_FIT_MIN_SAMPLES && DriftFit.SumEE > 0 ) {
+        int64_t PerKJ = (DriftFit.SumER*1000)/DriftFit.SumEE;
+
+        if( PerKJ >  0x7FFF ) PerKJ =  0x7FFF;
+        if( PerKJ < -0x7FFF ) PerKJ = -0x7FFF;
+
+        TransducerDrift(TransducerSet.DriftTime,PerKJ,TransducerSet.DriftMax);
+        }
+
+    DriftFit.Run = false;
+    return DriftFit.Samples;
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerOn - Enable/Disable transducer output
-//
-// Inputs:      TRUE  if output is ON
-//              FALSE otherwise
+// LoadState - Classify a load signature against the calibration
 //
-// Outputs:     None.
+// Inputs:      Load signature (see LOAD_SCALE)
 //
-void TransducerOn(bool On) {
+// Outputs:     Load state, LOAD_UNKNOWN if not calibrated
+//
+static TRANSDUCER_LOAD LoadState(uint16_t Sig) {
+    int32_t     Span = (int32_t) TransducerSet.LoadNormal - TransducerSet.LoadDry;
+    int32_t     Pos  = (int32_t) Sig                      - TransducerSet.LoadDry;
 
-    if( !On ) {
-        TransducerCurr.RunTimer = 0;
-        TransducerCurr.On       = false;
-        SG3525_OFF;
-        return;
+    if( TransducerSet.LoadDry == 0 || TransducerSet.LoadNormal == 0 || Span == 0 )
+        return LOAD_UNKNOWN;
+
+    //
+    // Measure from dry towards normal, whichever way that is for this horn
+    //
+    if( Span < 0 ) {
+        Span = -Span;
+        Pos  = -Pos;
         }
-
-    //
-    // Don't allow turn ON in EStop
-    //
-    if( TransducerCurr.EStop )
-        return;
-
-    //
-    // Set the run timer if needed
-    //
-    if( TransducerSet.RunMode == RUN_TIMED )
-        TransducerCurr.RunTimer = TransducerSet.RunTimer;
-
-    TransducerCurr.On = true;
-    SG3525_ON;
-    }
-
+
+    if( 2*Pos < Span )                      return LOAD_DRY;
+    if( Pos > Span*(1 + LOAD_OVER_SPANS) )  return LOAD_OVER;
+    return LOAD_OK;
+    }
+
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerRunMode - Set transducer run mode
+// ClassifyLoad - Work out what the horn is driving into, and act on it
 //
-// Inputs:      Run mode (RUN_CONTINUOUS/RUN_TIMED
-//              Ticks to run (in 1/25ths of a second)
+// The signature is filtered over a few frames, and a change of state has to hold for
+//   LOAD_CONFIRM_FRAMES, so that a single noisy frame doesn't stop the output.
 //
-// Outputs:     None.
+// Inputs:      None. Called each clean control frame
 //
+// Outputs:     None.
 //
-void TransducerRunMode(TRANSDUCER_RUN_MODE RunMode,uint16_t Ticks) {
-
-    TransducerSet.RunMode  = RunMode;
-    TransducerSet.RunTimer = Ticks;
+static void ClassifyLoad(void) {
+
+    if( !TransducerCurr.On || TransducerCurr.PWM < LOAD_MIN_PWM )
+        return;
+
+    uint16_t    Sig = ((uint32_t) TransducerCurr.Current*LOAD_SCALE)/TransducerCurr.PWM;
+
+    if( Load.Primed ) Load.Filter += (int32_t) Sig - (int32_t) (Load.Filter >> LOAD_FILTER_SHIFT);
+    else              Load.Filter  = (uint32_t) Sig << LOAD_FILTER_SHIFT;
+
+    Load.Primed            = true;
+    TransducerCurr.LoadSig = Load.Filter >> LOAD_FILTER_SHIFT;
+
+    //
+    // Calibrating - average the raw signature, and leave the output alone since the
+    //   horn may well be running dry on purpose.
+    //
+    if( Load.CalFrames ) {
+        Load.CalSum += Sig;
+
+        if( --Load.CalFrames == 0 ) {
+            uint16_t Ref = Load.CalSum/LOAD_CAL_FRAMES;
+
+            if( Ref == 0 )
+                Ref = 1;
+
+            if( Load.CalRef == LOAD_DRY ) TransducerSet.LoadDry    = Ref;
+            else                          TransducerSet.LoadNormal = Ref;
+
+            TransducerCurr.LoadCal = false;
+            }
+        return;
+        }
+
+    TRANSDUCER_LOAD State = LoadState(TransducerCurr.LoadSig);
+
+    if( State != Load.Pending ) {
+        Load.Pending = State;
+        Load.Confirm = 0;
+        return;
+        }
+
+    if( Load.Confirm < LOAD_CONFIRM_FRAMES ) {
+        Load.Confirm++;
+        return;
+        }
+
+    if( State == TransducerCurr.Load )
+        return;
+
+    TransducerCurr.Load = State;
+
+    if( TransducerSet.LoadPolicy == LOAD_STOP &&
+        (State == LOAD_DRY || State == LOAD_OVER) )
+        StopOutput();
     }
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerCtlMode - Set transducer ctl mode
+// AcquireResonance - Search for resonance at turn on
 //
-// Inputs:      Ctl mode (CTL_CONST_FREQ,CTL_MAX_EFF)
+// Sweep the band at a fixed drive level, looking for the frequency with the most
+//   current. Then sweep again around that point with a finer step, and so on. This
+//   finds the strongest peak in the band even when there are other, smaller peaks,
+//   which a bisection or golden-section search can't promise.
 //
-// Outputs:     None.
+// When done, hand over to the selected control mode at the frequency found.
 //
+// Inputs:      None. Called each control frame while TransducerCurr.Acquiring
 //
-void TransducerCtlMode(TRANSDUCER_CTL_MODE CtlMode) {
-
-    TransducerSet.CtlMode  = CtlMode;
+// Outputs:     None.
+//
+static void AcquireResonance(void) {
+
+    if( Acquire.Settle ) {
+        Acquire.Settle--;
+        return;
+        }
+
+    if( TransducerCurr.Current > Acquire.BestCurrent ) {
+        Acquire.BestCurrent = TransducerCurr.Current;
+        Acquire.BestFreq    = Acquire.Freq;
+        }
+
+    //
+    // Next point in this sweep
+    //
+    if( Acquire.Freq + Acquire.Step <= Acquire.Hi ) {
+        Acquire.Freq  += Acquire.Step;
+        Acquire.Settle = ACQ_SETTLE_FRAMES;
+        TransducerSet.Freq = Acquire.Freq;
+        return;
+        }
+
+    //
+    // End of the sweep. Narrow in on the best point, unless we're fine enough.
+    //
+    if( Acquire.Step > ACQ_FINE_STEP ) {
+        AcquireSweep(Acquire.BestFreq - Acquire.Step,
+                     Acquire.BestFreq + Acquire.Step,
+                     Acquire.Step/ACQ_STEP_DIVISOR);
+        return;
+        }
+
+    //
+    // Done. Hand over to the power loop from a predicted wiper, as at turn on. If
+    //   nothing was measured (no load), BestFreq is still the setup frequency.
+    //
+    TransducerSet.Freq       = Acquire.BestFreq;
+    TransducerCurr.PWMWiper  = PredictWiper(Acquire.BestFreq,StartPower());
+    Regulator.Run            = false;
+    TransducerCurr.Acquiring = false;
+    TrackReset();
+
+    if( TransducerSet.RunMode == RUN_PULSED )
+        PulseStart();
     }
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerFreq - Set transducer output frequency
+// ApplySetup - Put in all the settings from a setup
 //
-// Inputs:      Frequency to set (Hz)
+// Inputs:      Setup to use (may be TransducerSet itself)
+//              TRUE if switching while running
 //
 // Outputs:     None.
 //
+// Everything goes through the setters, so that a run mode change while running is
+//   handled as if the user had typed it.
 //
-void TransducerFreq(uint16_t Freq) {
-
-    TransducerSet.Freq = Freq;
-
-    AD9833Output(AD9833_SQ,TransducerSet.Freq);
+// When switching, the control mode and dither are only set if they changed, since
+//   setting them restarts the tracker and the sweep. Max efficiency keeps the
+//   frequency it's tracked to, rather than jumping to the one saved in the setup.
+//
+static void ApplySetup(TRANSDUCER_SET *Set,bool Bumpless) {
+    bool    CtlChanged    = !Bumpless || Set->CtlMode    != TransducerSet.CtlMode;
+    bool    DitherChanged = !Bumpless || Set->DitherDev  != TransducerSet.DitherDev  ||
+                                         Set->DitherRate != TransducerSet.DitherRate ||
+                                         Set->DitherWave != TransducerSet.DitherWave;
+
+    if( CtlChanged || Set->CtlMode != CTL_MAX_EFF )
+        TransducerFreq(Set->Freq);
+
+    TransducerPower  (Set->Power);
+    TransducerCurrent(Set->Current,Set->CurrentSlew);
+    TransducerPwrGains(Set->PwrKp,Set->PwrKi,Set->PwrDB);
+    TransducerRunMode(Set->RunMode,Set->RunTimer);
+    TransducerPulse  (Set->PulseOn,Set->PulseOff,Set->PulseCount);
+    TransducerDose   (Set->Energy);
+    if( CtlChanged )
+        TransducerCtlMode(Set->CtlMode);
+    TransducerTrackStep(Set->TrackStep);
+    if( DitherChanged )
+        TransducerDither(Set->DitherDev,Set->DitherRate,Set->DitherWave);
+    TransducerAcquire(Set->Acquire);
+    TransducerDrift  (Set->DriftTime,Set->DriftEnergy,Set->DriftMax);
+    TransducerThermal(Set->ThermRated,Set->ThermHeat,Set->ThermCool,
+                      Set->ThermDerate,Set->ThermTrip);
+    TransducerRetune (Set->RetuneMax);
+    TransducerLoad   (Set->LoadPolicy,Set->LoadDry,Set->LoadNormal);
+    TransducerRamp   (Set->RampMode,Set->RampTime);
+
+    TransducerSet.Input1 = Set->Input1;
+    TransducerSet.Input2 = Set->Input2;
+
+    TransducerCurr.Switching = false;
     }
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerPower - Set transducer output power
+// TransducerSetup - Load settings from TransducerSet variable
 //
-// Inputs:      Power to set, in watts*10 (ie: 315 means 31.5 watts)
+// Inputs:      None.
 //
 // Outputs:     None.
 //
 //
-void TransducerPower(uint16_t Power) {
+void TransducerSetup(void) {
+
+    ApplySetup(&TransducerSet,false);
+    }
+
 
-    TransducerSet.Power = Power;
-    }
-
-
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// AdjustPower - Station keeping for power setpoint
+// TransducerSwitch - Switch to a new setup
 //
-// Inputs:      None. Called periodically by the update program
+// Inputs:      Setup to switch to
 //
 // Outputs:     None.
 //
-static void AdjustPower(void) {
+void TransducerSwitch(TRANSDUCER_SET *Setup) {
 
     //
-    // If we're not actually on, then adjusting power will have no effect.
+    // Nothing to disturb when off, so put it all in at once
     //
-    if( !TransducerCurr.On )
+    if( !TransducerCurr.On ) {
+        DISABLE_CONTROL;
+        TransducerSet = *Setup;
+        ENABLE_CONTROL;
+        TransducerSetup();
         return;
+        }
 
     //
-    // Otherwise, adjust the power wiper until the desired power output
+    // Otherwise let the control tick slew to it, and TransducerUpdate() finish up
     //
-    if( TransducerCurr.Power > TransducerSet.Power ) {
-        //
-        // If the PWM is already minimum, then adjusting will have
-        //   no effect.
-        //
-        if( TransducerCurr.PWM == 0 )
-            return;
-
-        if( TransducerCurr.PWMWiper == 0 )
-            return;
-
-        PWMPotSetWiper(--TransducerCurr.PWMWiper);
-#       ifdef SHOW_PWR_TUNING
-        PrintChar('<');
-#       endif
-        return;
-        }
-
-    if( TransducerCurr.Power < TransducerSet.Power ) {
-        //
-        // If the PWM is already maximum, then adjusting will have
-        //   no effect.
-        //
-        // Note that by design, the SG3525 controller only goes to 98% PWM
-        //   due to dead time.
-        //
-        if( TransducerCurr.PWM > 96*10 )
-            return;
-
-        if( TransducerCurr.PWMWiper >= PWMPot_MAX_WIPER )
-            return;
-
-        PWMPotSetWiper(++TransducerCurr.PWMWiper);
-#       ifdef SHOW_PWR_TUNING
-        PrintChar('>');
-#       endif
-
-        return;
-        }
+    DISABLE_CONTROL;
+    Switch.Set               = Setup;
+    Switch.Ready             = false;
+    TransducerCurr.Switching = true;
+    ENABLE_CONTROL;
     }
+
 
-
+//////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerSetup - Load settings from TransducerSet variable
+// TransducerUpdate - Update the transducer driver
 //
-// Inputs:      None.
+// Inputs:      None
 //
 // Outputs:     None.
+//
+// NOTE: Called by timer update, not for public consumption
 //
+// Measurement and control happen in TransducerControl(), this only takes care of the
+//   things that run at user interface speed.
 //
-void TransducerSetup(void) {
-
-    TransducerFreq   (TransducerSet.Freq);
-    TransducerPower  (TransducerSet.Power);
-    TransducerRunMode(TransducerSet.RunMode,TransducerSet.RunTimer);
-    TransducerCtlMode(TransducerSet.CtlMode);
-    }
+void TransducerUpdate(void) {
+
+    //
+    // Update all subordinate components
+    //
+    InputsUpdate();
+    RecipeUpdate();
+    DriftSample();
+    FaultUpdate();
+
+    //
+    // Put in a switched setup once the control tick has slewed to it
+    //
+    if( TransducerCurr.Switching && Switch.Ready )
+        ApplySetup(Switch.Set,true);
+
+    //
+    // If we're running on timer, decrement and possibly stop
+    //
+    if( TransducerCurr.On && TransducerSet.RunMode == RUN_TIMED && Ramp.Dir >= 0 ) {
+        if( --TransducerCurr.RunTimer == 0 )
+            TransducerOn(false);
+        }
+
+    //
+    // Save anything we learned about the power map, but only while off so that the
+    //   control tick isn't still changing it.
+    //
+    if( !TransducerCurr.On && PwrMapDirty ) {
+        EEPROMUpdate(&EEPROM.PwrMap,sizeof(EEPROM.PwrMap));
+        PwrMapDirty = false;
+        }
+
+#   ifdef SHOW_PWR_TUNING
+    static uint16_t ShownWiper;
+
+    if( TransducerCurr.PWMWiper != ShownWiper ) {
+        PrintChar(TransducerCurr.PWMWiper > ShownWiper ? '>' : '<');
+        ShownWiper = TransducerCurr.PWMWiper;
+        }
+#   endif
+
+#   ifdef SHOW_FREQ_TUNING
+    static uint16_t ShownFreq;
+
+    if( TransducerSet.Freq != ShownFreq ) {
+        PrintChar(TransducerSet.Freq > ShownFreq ? '+' : '-');
+        ShownFreq = TransducerSet.Freq;
+        }
+#   endif
+    }
+
 
-
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
-// TransducerUpdate - Update the transducer driver
+// TransducerCalcPower - Calculate output power
+//
+// Inputs:      Current (amps x 100)
+//              Supply  (volts x 100)
+//              PWM     (% x 10)
+//
+// Outputs:     Power (watts x 10)
+//
+uint16_t TransducerCalcPower(int16_t Current,uint16_t Volts,uint16_t PWM) {
+
+    if( Current <= 0 )
+        return 0;
+
+    uint32_t    PwrTemp;
+
+    PwrTemp  = ((uint32_t) Current*Volts + 8) >> 4;
+    PwrTemp  = (PwrTemp*PWM + 128) >> 8;
+
+    return (PwrTemp*POWER_RECIP + (1UL << 18)) >> 19;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerControl - Measure and drive the transducer
+//
+// Every CONTROL_FRAME_TICKS ticks we collect the PWM and current measurements from the
+//   frame just ended, and run the control loops on them. The results are sent to the
+//   AD9833 and power pot at the next tick.
+//
+// All SPI traffic happens here, so that the user commands never collide with it. The
+//   commands just change the settings, and we pick up the changes on the next tick.
 //
 // Inputs:      None
 //
 // Outputs:     None.
-//
-// NOTE: Called by timer update, not for public consumption
 //
-void TransducerUpdate(void) {
+// NOTE: Called by the control tick (see Control.h), not for public consumption
+//
+void TransducerControl(void) {
 
     //
-    // Update all subordinate components
+    // The AtoD interrupt has already shut off the driver on an overcurrent trip, so
+    //   stop everything else and latch the fault as an EStop.
+    //
+    if( ACS712Tripped() && !TransducerCurr.Tripped ) {
+        FaultRaise(FAULT_OVERCURRENT);
+        StopOutput();
+        TransducerCurr.EStop   = true;
+        TransducerCurr.Tripped = true;
+        }
+
+    //
+    // Pulse gating. Edges happen here, on the tick, regardless of what else is going on.
+    //
+    if( TransducerCurr.On && TransducerSet.RunMode == RUN_PULSED &&
+        !TransducerCurr.Acquiring )
+        PulseUpdate();
+
+    if( !SG3525_IS_ON )
+        Frame.Gated = true;
+
+    //
+    // Actuate - send any changes out to the hardware. In the fixed frequency modes, the
+    //   thermal drift model moves the output to follow resonance as the horn warms,
+    //   and FM dither sweeps it around that.
+    //
+    uint16_t Freq = TransducerSet.Freq;
+
+    if( TransducerSet.CtlMode != CTL_MAX_EFF && !TransducerCurr.Acquiring ) {
+        Freq += TransducerCurr.Drift + TransducerCurr.Retune;
+        if( TransducerSet.CtlMode == CTL_FREQ_MOD )
+            Freq += DitherUpdate();
+        if( Freq < TRANSDUCER_MIN_FREQ ) Freq = TRANSDUCER_MIN_FREQ;
+        if( Freq > TRANSDUCER_MAX_FREQ ) Freq = TRANSDUCER_MAX_FREQ;
+        }
+
+    //
+    // Frequency changes are phase continuous, so the horn doesn't see a glitch each
+    //   time the tracker or dither moves.
+    //
+    if( !AD9833IsOn() )
+        AD9833Output(AD9833_SQ,Freq);
+    else if( AD9833GetFreq() != Freq )
+        AD9833SetFreq(Freq);
+
+    //
+    // With no regulator, the soft start/stop ramp scales the wiper directly
+    //
+#ifdef USE_WIPER_CMDS
+    uint8_t Wiper = ((uint16_t) TransducerCurr.PWMWiper*RampScale()) >> 8;
+#else
+    uint8_t Wiper = TransducerCurr.PWMWiper;
+#endif
+
+    if( Frame.Wiper != Wiper )
+        PWMPotSetWiper(Frame.Wiper = Wiper);
+
+    if( --Frame.Ticks > 0 )
+        return;
+
+    Frame.Ticks = CONTROL_FRAME_TICKS;
+
+    //
+    // Measure - collect the frame
     //
     PWMUpdate();
     ACS712Update();
-    InputsUpdate();
 
     //
     // If we're running, use the PWM version of frequency since it's the most accurate.
@@ -369,25 +2387,104 @@ void TransducerUpdate(void) {
     TransducerCurr.Freq    = GetPWMFreq();
     TransducerCurr.PWM     = GetPWM()*2;
     TransducerCurr.Current = ACS712GetCurrent();
+    TransducerCurr.Volts   = ACS712GetSupply();
 
-    //
-    // PWM is % x 10, Current is in Amps x 10, and drive is 12 volts
-    //
-    // Multiply everything together and divide by 10 to get power in Watts x 10
-    //
-    uint32_t    PwrTemp;
-
-    PwrTemp  = TransducerCurr.Current*TRANSDUCER_DRIVE_VOLTS;
-    PwrTemp *= TransducerCurr.PWM;
-    PwrTemp /= 1000;
-    TransducerCurr.Power = (uint16_t) PwrTemp;
-
+    TransducerCurr.Power   = TransducerCalcPower(ACS712GetCurrentFine(),
+                                                 TransducerCurr.Volts,
+                                                 TransducerCurr.PWM);
+
     //
-    // If we're running on timer, decrement and possibly stop
+    // A sagging supply stops the output, and holds it off until it recovers
     //
-    if( TransducerCurr.On && TransducerSet.RunMode == RUN_TIMED ) {
-        if( --TransducerCurr.RunTimer == 0 )
-            TransducerOn(false);
+    if( TransducerCurr.Volts < SUPPLY_MIN_VOLTS ) {
+        if( !TransducerCurr.UnderVolt && TransducerCurr.On ) {
+            FaultRaise(FAULT_UNDER_VOLT);
+            StopOutput();
+            }
+        TransducerCurr.UnderVolt = true;
+        }
+    else if( TransducerCurr.Volts >= SUPPLY_MIN_VOLTS + SUPPLY_HYST_VOLTS )
+        TransducerCurr.UnderVolt = false;
+
+    ThermalUpdate();
+
+    //
+    // Integrate the energy delivered. Power is constant over the frame, so each
+    //   frame adds Power in units of (watts x 10) x frames.
+    //
+    // When an energy dose is reached, stop just as TransducerOn(false) would.
+    //
+    if( TransducerCurr.On ) {
+        TransducerCurr.Energy += TransducerCurr.Power;
+
+        if( TransducerSet.RunMode == RUN_ENERGY && Ramp.Dir >= 0 &&
+            TransducerCurr.Energy >= TransducerSet.Energy*ENERGY_PER_JOULE ) {
+            if( TransducerSet.RampMode != RAMP_NONE ) RampStart(-1);
+            else                                      StopOutput();
+            }
+        }
+
+    DriftUpdate();
+
+    //
+    // The resonance search at turn on holds everything else off until it's done
+    //
+    if( TransducerCurr.Acquiring ) {
+        Frame.Gated = false;
+        AcquireResonance();
+        return;
+        }
+
+    RampUpdate();
+    SwitchUpdate();
+
+    //
+    // If the output was gated off for any part of the frame (ie - between pulses), the
+    //   measurements don't mean anything. Hold the control loops where they are until
+    //   we get a clean frame.
+    //
+    // Note that pulses shorter than two frames never get a clean frame, and just run
+    //   at the wiper predicted by the power map.
+    //
+    if( Frame.Gated ) {
+        Frame.Gated = false;
+        if( TransducerCurr.On )
+            return;
+        }
+
+    //
+    // See what we're driving into before regulating, so that derating takes effect
+    //   in this frame
+    //
+    ClassifyLoad();
+
+    //
+    // All the control modes hold the power setpoint
+    //
+#ifndef USE_WIPER_CMDS
+    RegulatePower();
+    RetuneHeadroom();
+#endif
+
+    //
+    // Faults that only show up while running. Each has to last a while before it
+    //   stops the output (see Fault.h).
+    //
+    bool    Running = TransducerCurr.On && Ramp.Dir == 0;
+    uint8_t Faults  = 0;
+
+    Faults |= FaultCheck(FAULT_NO_PWM   ,Running && TransducerCurr.Freq == 0,
+                                         FAULT_PWM_FRAMES);
+    Faults |= FaultCheck(FAULT_FREQ_BAND,Running && TransducerCurr.Freq != 0 &&
+                                        (TransducerCurr.Freq < TRANSDUCER_MIN_FREQ ||
+                                         TransducerCurr.Freq > TRANSDUCER_MAX_FREQ),
+                                         FAULT_BAND_FRAMES);
+    Faults |= FaultCheck(FAULT_NO_POWER ,Running && Regulator.Saturated,
+                                         FAULT_POWER_FRAMES);
+
+    if( Faults ) {
+        StopOutput();
+        return;
         }
 
     switch(TransducerSet.CtlMode) {
@@ -396,9 +2493,8 @@ void TransducerUpdate(void) {
         //
         // CTL_CONST_FREQ - Set constant frequency and power
         //
-        case CTL_CONST_FREQ:
-//            AdjustPower();
-            break;
+        case CTL_CONST_FREQ:
+            break;
 
 
         //////////////////////////////////////////////////////////////////////////////////
@@ -406,6 +2502,24 @@ void TransducerUpdate(void) {
         // CTL_MAX_EFF - Keep maximum efficiency
         //
         case CTL_MAX_EFF:
+            if( !TransducerCurr.Switching )
+                TrackResonance();
+            break;
+
+
+        //////////////////////////////////////////////////////////////////////////////////
+        //
+        // CTL_FREQ_MOD - Constant power, dither is done at the tick
+        //
+        case CTL_FREQ_MOD:
+            break;
+
+
+        //////////////////////////////////////////////////////////////////////////////////
+        //
+        // CTL_CONST_CURRENT - Constant frequency, the regulator holds the current
+        //
+        case CTL_CONST_CURRENT:
             break;
 
 
@@ -95,14 +95,62 @@
 //
 // Uncomment this to print single-chars that show the power tuning
 //
-#define SHOW_PWR_TUNING
+//#define SHOW_PWR_TUNING
 
 //
 // Uncomment this to disable power tracking and allow direct wiper setting
 //   commands
 //
-#define USE_WIPER_CMDS
+//#define USE_WIPER_CMDS
 
+//
+// Power regulator parameters
+//
+// The regulator won't push the wiper up once the PWM reaches this limit (in % x 10).
+//   By design the SG3525 only goes to 98% PWM due to dead time, so anything past
+//   this is wasted effort and would only wind up the integrator.
+//
+#define PWR_MAX_PWM             (96*10)
+
+//
+// Power limited detection
+//
+// Once the regulator has been out of PWM for PWR_LIMIT_FRAMES control frames with the
+//   power still short, the setpoint is unreachable and TransducerCurr.PowerLimited is
+//   set. It clears when the PWM drops back below PWR_HEADROOM_PWM.
+//
+// If TransducerSet.RetuneMax is set, the fixed frequency modes then step the output
+//   frequency (by TransducerSet.TrackStep) toward resonance, up to RetuneMax Hz away,
+//   to get some headroom back. When there's headroom again, the frequency steps back.
+//
+// If retuning doesn't help, the power fault (see Fault.h) stops the output.
+//
+#define PWR_LIMIT_FRAMES        25
+#define PWR_HEADROOM_PWM        (88*10)
+
+//
+// Power map learning parameters
+//
+// The map is only updated once the regulator has held the power within the deadband
+//   for this many control frames, and a map entry is only changed when the prediction is off by
+//   at least this many wiper counts. The latter keeps a converged map from rewriting
+//   the EEPROM every time the transducer turns off.
+//
+#define PWR_MAP_SETTLE_FRAMES   20
+#define PWR_MAP_MIN_ERROR       2
+
+//
+// Resonance tracking (CTL_MAX_EFF) parameters
+//
+// The tracker steps the frequency by TransducerSet.TrackStep Hz, then waits this many
+//   control frames for the horn and the measurements to settle before comparing.
+//
+// The tracker is considered locked after this many consecutive short reversals
+//   (ie - it is dithering back and forth across the peak).
+//
+#define TRACK_SETTLE_FRAMES     4
+#define TRACK_LOCK_COUNT        4
+
 //
 // End of user configurable options
 //
@@ -119,7 +167,137 @@
 #define TRANSDUCER_MIN_POWER    0           // Minimum power we allow
 #define TRANSDUCER_MAX_POWER    (100*10)    // Maximum power we allow (in watts x 10)
 
-#define TRANSDUCER_DRIVE_VOLTS  12          // Volts in driver circuit
+#define TRANSDUCER_DRIVE_VOLTS  12          // Nominal volts in driver circuit
+
+//
+// The driver supply is measured (see ACS712.h) and used in the power calculation.
+//   Below SUPPLY_MIN_VOLTS the output is stopped and can't be turned on, until the
+//   supply comes back above SUPPLY_MIN_VOLTS + SUPPLY_HYST_VOLTS.
+//
+#define SUPPLY_MIN_VOLTS        1050        // Under voltage level (volts x 100)
+#define SUPPLY_HYST_VOLTS       50          // Hysteresis          (volts x 100)
+
+#define TRANSDUCER_DEF_CURRENT  (1*10)      // Default current   (amps x 10)
+#define TRANSDUCER_MAX_CURRENT  (10*10)     // Maximum current we allow (amps x 10)
+#define TRANSDUCER_DEF_SLEW     (2*10)      // Default current slew (amps x 10 per sec)
+
+//
+// In CTL_CONST_CURRENT the power regulator works on current instead. Current errors
+//   are scaled to the power error they'd make at 50% PWM, so the same gains do for both.
+//
+#define CURRENT_GAIN_SCALE      (TRANSDUCER_DRIVE_VOLTS/2)
+
+#define TRANSDUCER_DEF_TRACK    10          // Default tracking step (Hz)
+#define TRANSDUCER_MAX_TRACK    200         // Maximum tracking step we allow (Hz)
+
+#define TRANSDUCER_MAX_RETUNE   250         // Maximum headroom retune we allow (Hz)
+
+//
+// Resonance acquisition at turn on. The whole band is swept in coarse steps, then
+//   the sweep is repeated around the best point with the step divided down, until
+//   the step is fine enough. Each point takes ACQ_SETTLE_FRAMES+1 control frames.
+//
+// With the defaults that's 30 + 3 x 9 points, or about 1.1 secs.
+//
+#define ACQ_POWER               50          // Max power while searching (watts x 10)
+#define ACQ_COARSE_STEP         512         // First sweep step (Hz)
+#define ACQ_FINE_STEP           8           // Last  sweep step (Hz)
+#define ACQ_STEP_DIVISOR        4           // Step reduction between sweeps
+#define ACQ_SETTLE_FRAMES       1           // Frames to wait after changing freq
+
+//
+// Thermal drift model, for CTL_CONST_FREQ and CTL_FREQ_MOD. As the horn warms up its resonance falls,
+//   so the output frequency is offset by
+//
+//      DriftTime   x (secs of on time)  +
+//      DriftEnergy x (kJ delivered)
+//
+//   (both in mHz), limited to +/- DriftMax Hz. The model starts from zero at each
+//   turn on, so assumes the horn has cooled off in between.
+//
+#define TRANSDUCER_DEF_DRIFT_MAX    50      // Default drift limit (Hz)
+#define DRIFT_FIT_MIN_SAMPLES       60      // Fewest 1 sec samples to fit from
+
+//
+// Stack thermal (I squared t) model. There's no sensor on the stack, so its temperature
+//   rise is modelled as a first order lag on current squared:
+//
+//      Heat += ((Current/ThermRated)^2 - Heat) x (frame time)/(time constant)
+//
+//   using the ThermHeat time constant (secs) when warming and ThermCool when cooling.
+//   Heat is in % of the rise from running steadily at the rated current.
+//
+// Past ThermDerate % the power setpoint is scaled down, to zero at ThermTrip %, where
+//   the output trips (see Fault.h). It can't be turned on again until the model has
+//   cooled to ThermDerate %.
+//
+// The model runs all the time, cooling while the output is off, so a short stop
+//   doesn't forget how hot the stack is. Changing setups keeps the heat as well.
+//
+#define TRANSDUCER_DEF_THERM_HEAT   120     // Default heating time constant (secs)
+#define TRANSDUCER_DEF_THERM_COOL   300     // Default cooling time constant (secs)
+#define TRANSDUCER_DEF_THERM_DERATE 90      // Default derate level (% of rated)
+#define TRANSDUCER_DEF_THERM_TRIP   110     // Default trip   level (% of rated)
+#define THERM_MAX_RATIO             (4*256) // Largest current/rated, x 256
+
+//
+// A setup loaded while running is switched in bumplessly (see TransducerSwitch). The
+//   frequency, power, and current setpoints slew to the new values at these rates,
+//   and the new modes are put in once they get there.
+//
+#define SWITCH_FREQ_SLEW            5       // Hz         per frame (500 Hz/sec)
+#define SWITCH_PWR_SLEW             10      // watts x 10 per frame (100 watts/sec)
+#define SWITCH_CURR_SLEW            1       // amps  x 10 per frame (10 amps/sec)
+
+//
+// Load classifier. The load signature is current per unit of drive (amps per % PWM,
+//   x LOAD_SCALE), which hardly changes with power level but moves a long way between
+//   a horn running in air, in the work, and jammed.
+//
+// Calibration averages the signature over LOAD_CAL_FRAMES control frames, once running
+//   dry and once under a normal load. Then while running:
+//
+//      Nearer the dry reference than the normal one        -> LOAD_DRY
+//      Past the normal reference by more than LOAD_OVER_SPANS
+//        times the distance between the two                -> LOAD_OVER
+//      Anything else                                       -> LOAD_OK
+//
+//   A new state has to hold for LOAD_CONFIRM_FRAMES before it's acted on. Which way
+//   the signature moves with load depends on the horn, and the calibration takes
+//   care of that.
+//
+#define LOAD_SCALE              4096        // Signature units per amp per % PWM
+#define LOAD_MIN_PWM            (10*10)     // Too little drive to tell below this
+#define LOAD_FILTER_SHIFT       3           // Signature filter, 2^n frames
+#define LOAD_CAL_FRAMES         200         // Frames averaged for a calibration
+#define LOAD_CONFIRM_FRAMES     25          // Frames a new state has to hold
+#define LOAD_OVER_SPANS         1           // Overload threshold, see above
+#define LOAD_DERATE_PCT         50          // Power when derated (% of setpoint)
+
+//
+// FM dither (CTL_FREQ_MOD). The output frequency is swept +/- DitherDev Hz around
+//   TransducerSet.Freq, DitherRate times a second, to break up standing waves. The
+//   sweep is updated every control tick, so at the maximum rate there are still 10
+//   steps per sweep.
+//
+#define TRANSDUCER_DEF_DITHER_DEV   100     // Default deviation (Hz)
+#define TRANSDUCER_MAX_DITHER_DEV   1000    // Maximum deviation we allow (Hz)
+#define TRANSDUCER_DEF_DITHER_RATE  10      // Default sweep rate (Hz)
+#define TRANSDUCER_MAX_DITHER_RATE  100     // Maximum sweep rate we allow (Hz)
+
+//
+// Power regulator gains are in 1/256ths of a wiper count per (watt x 10) of error.
+//   The defaults assume roughly 4 (watts x 10) per wiper count, and settle in about
+//   ten control frames with no overshoot.
+//
+#define TRANSDUCER_DEF_PWR_KP   16          // Default proportional gain
+#define TRANSDUCER_DEF_PWR_KI   32          // Default integral     gain (per frame)
+#define TRANSDUCER_DEF_PWR_DB   5           // Default deadband (watts x 10)
+
+#define TRANSDUCER_DEF_RAMP     250         // Default ramp time (ms)
+
+#define TRANSDUCER_DEF_DOSE     1000        // Default energy dose (joules)
+#define TRANSDUCER_MAX_DOSE     1000000     // Maximum energy dose we allow (joules)
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -129,9 +307,11 @@
 typedef enum {
     RUN_CONTINUOUS = 100,           // On stays on
     RUN_TIMED,                      // Timed run
+    RUN_PULSED,                     // On/off pulses, timed in ms
+    RUN_ENERGY,                     // Run until an energy dose is delivered
     } TRANSDUCER_RUN_MODE;
 
-#define NUM_RUN_MODES   ( RUN_TIMED - RUN_CONTINUOUS + 1 )
+#define NUM_RUN_MODES   ( RUN_ENERGY - RUN_CONTINUOUS + 1 )
 
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -141,11 +321,61 @@ typedef enum {
 typedef enum {
     CTL_CONST_FREQ = 200,           // Constant freq and power
     CTL_MAX_EFF,                    // Constant power, max efficiency
+    CTL_FREQ_MOD,                   // Constant power, freq dithered around setting
+    CTL_CONST_CURRENT,              // Constant freq and current
     } TRANSDUCER_CTL_MODE;
 
-#define NUM_CTL_MODES     ( CTL_MAX_EFF - CTL_CONST_FREQ + 1 )
+#define NUM_CTL_MODES     ( CTL_CONST_CURRENT - CTL_CONST_FREQ + 1 )
 #define IDX_CTL_MODE(_x_) (_x_ - CTL_CONST_FREQ)        // Index of 1st power mode
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// RampMode - How power comes up at turn on, and goes down at turn off
+//
+typedef enum {
+    RAMP_NONE = 400,                // Full power immediately
+    RAMP_LINEAR,                    // Straight line over ramp time
+    RAMP_SCURVE,                    // Smooth start and finish over ramp time
+    } TRANSDUCER_RAMP_MODE;
+
+#define NUM_RAMP_MODES     ( RAMP_SCURVE - RAMP_NONE + 1 )
+#define IDX_RAMP_MODE(_x_) (_x_ - RAMP_NONE)            // Index of 1st ramp mode
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// Load - What the horn is driving into, from the load classifier
+//
+typedef enum {
+    LOAD_UNKNOWN = 600,             // Not running, or not calibrated
+    LOAD_DRY,                       // Running in air
+    LOAD_OK,                        // Normal load
+    LOAD_OVER,                      // Overloaded or jammed
+    } TRANSDUCER_LOAD;
+
+//
+// LoadPolicy - What to do about a dry or overloaded horn
+//
+typedef enum {
+    LOAD_FLAG = 700,                // Just show it
+    LOAD_DERATE,                    // Cut the power to LOAD_DERATE_PCT
+    LOAD_STOP,                      // Turn the output off
+    } TRANSDUCER_LOAD_POLICY;
+
+#define NUM_LOAD_POLICIES     ( LOAD_STOP - LOAD_FLAG + 1 )
+#define IDX_LOAD_POLICY(_x_)  (_x_ - LOAD_FLAG)         // Index of 1st load policy
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// DitherWave - Shape of the FM dither sweep
+//
+typedef enum {
+    DITHER_TRIANGLE = 800,          // Straight up and down between the limits
+    DITHER_RANDOM,                  // Straight lines between random points
+    } TRANSDUCER_DITHER_WAVE;
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -178,11 +408,42 @@ typedef struct {
 typedef struct {
     uint16_t            Freq;       // Requested target frequency (Hz)
     uint16_t            Power;      // Requested target power     (watts x 10)
+    uint16_t            Current;    // Requested target current   (amps x 10)
+    uint16_t            CurrentSlew;// Current setpoint slew (amps x 10 per sec, 0 == none)
+    uint8_t             PwrKp;      // Power regulator proportional gain
+    uint8_t             PwrKi;      // Power regulator integral     gain
+    uint8_t             PwrDB;      // Power regulator deadband   (watts x 10)
 
     TRANSDUCER_RUN_MODE RunMode;    // Mode, when running
     uint16_t            RunTimer;   // Countdown timer, when in RUN_TIMED mode
+    uint16_t            PulseOn;    // Pulse on  time, when in RUN_PULSED mode (ms)
+    uint16_t            PulseOff;   // Pulse off time, when in RUN_PULSED mode (ms)
+    uint16_t            PulseCount; // Number of pulses (0 == forever)
+    uint32_t            Energy;     // Energy dose, when in RUN_ENERGY mode (joules)
 
     TRANSDUCER_CTL_MODE CtlMode;    // Control output mode
+    uint8_t             TrackStep;  // Tracking step, when in CTL_MAX_EFF mode (Hz)
+    uint8_t             RetuneMax;  // Limit on headroom retune (Hz, 0 == off)
+    uint16_t            DitherDev;  // Deviation,  when in CTL_FREQ_MOD mode (+/- Hz)
+    uint8_t             DitherRate; // Sweep rate, when in CTL_FREQ_MOD mode (Hz)
+    TRANSDUCER_DITHER_WAVE DitherWave;// Sweep shape
+    bool                Acquire;    // TRUE to search for resonance at turn on
+    int16_t             DriftTime;  // Freq drift per sec of on time (mHz)
+    int16_t             DriftEnergy;// Freq drift per kJ delivered   (mHz)
+    uint8_t             DriftMax;   // Limit on drift correction (Hz)
+
+    uint8_t             ThermRated; // Thermal model rated current (amps x 10, 0 == off)
+    uint16_t            ThermHeat;  // Heating time constant (secs)
+    uint16_t            ThermCool;  // Cooling time constant (secs)
+    uint8_t             ThermDerate;// Heat to start derating at (% of rated)
+    uint8_t             ThermTrip;  // Heat to trip at (% of rated)
+
+    TRANSDUCER_LOAD_POLICY LoadPolicy;// What to do when dry or overloaded
+    uint16_t            LoadDry;    // Load signature running dry (0 == uncalibrated)
+    uint16_t            LoadNormal; // Load signature under normal load
+
+    TRANSDUCER_RAMP_MODE RampMode;  // Soft start/stop profile
+    uint16_t            RampTime;   // Time to ramp full power up or down (ms)
 
     INPUT               Input1;     // Input actions
     INPUT               Input2;
@@ -198,17 +459,55 @@ typedef struct {
     uint16_t    Freq;       // Current frequency
     uint16_t    Power;      // Transducer power, in watts x 10
     uint16_t    RunTimer;   // Countdown timer, when in RUN_TIMED mode
+    uint16_t    Pulses;     // Pulses left,    when in RUN_PULSED mode
+    uint32_t    Energy;     // Energy delivered this run (see TransducerGetEnergy)
     uint16_t    Current;    // Current (amps)
+    uint16_t    Volts;      // Supply voltage (volts x 100)
 
     uint16_t    PWM;        // PWM, in     % x 10
     uint16_t    PWMWiper;   // Current PWM         wiper
 
     bool        EStop;      // TRUE if we are in EStop
     bool        On;         // TRUE if transducer is turned ON
+    bool        Locked;     // TRUE if CTL_MAX_EFF is locked onto resonance
+    bool        Acquiring;  // TRUE while searching for resonance at turn on
+    bool        Tripped;    // TRUE if EStop was caused by an overcurrent trip
+    bool        UnderVolt;  // TRUE while the supply is under voltage
+    int16_t     Drift;      // Drift correction applied to frequency (Hz)
+    TRANSDUCER_LOAD Load;   // Load state, from the load classifier
+    uint16_t    LoadSig;    // Filtered load signature (see LOAD_SCALE)
+    bool        LoadCal;    // TRUE while calibrating the load classifier
+    bool        PowerLimited;// TRUE while the power setpoint is out of reach
+    uint16_t    Heat;       // Modelled stack heat (% of rated, see ThermRated)
+    uint16_t    HeatScale;  // Power allowed by the thermal model (x 256)
+    bool        Hot;        // TRUE from a thermal trip until cooled to ThermDerate
+    bool        Switching;  // TRUE while a new setup is being switched in
+    int16_t     Retune;     // Headroom retune applied to frequency (Hz)
     } TRANSDUCER_CURR;
 
 extern TRANSDUCER_CURR TransducerCurr;
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PwrMap - Learned wiper setting needed for a given power, by frequency band
+//
+// Bands are 2048 Hz wide starting at TRANSDUCER_MIN_FREQ, and power points are every
+//   128 (watts x 10) starting at zero. Intermediate powers are interpolated.
+//
+// The map is kept in the EEPROM (see EEPROM.h), next to the setups.
+//
+#define PWR_MAP_BAND_SHIFT      11
+#define PWR_MAP_BANDS           (((TRANSDUCER_MAX_FREQ-TRANSDUCER_MIN_FREQ) >> PWR_MAP_BAND_SHIFT) + 1)
+
+#define PWR_MAP_POINT_SHIFT     7
+#define PWR_MAP_POINTS          ((TRANSDUCER_MAX_POWER >> PWR_MAP_POINT_SHIFT) + 2)
+
+#define PWR_MAP_SEED_WIPER      30          // Wiper at zero power, for an unlearned map
+
+typedef struct {
+    uint8_t     Wiper[PWR_MAP_BANDS][PWR_MAP_POINTS];
+    } PWR_MAP;
+
 //
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -267,6 +566,9 @@ void TransducerInit(void);
 //
 // Outputs:     None.
 //
+// NOTE: An overcurrent trip (see ACS712.h) puts us into EStop with TransducerCurr.Tripped
+//         set. Clearing the EStop clears the trip.
+//
 void TransducerEStop(bool EStop);
 
 
@@ -283,9 +585,31 @@ void TransducerEStop(bool EStop);
 // NOTE: If TRANSDUCERCurr.RunMode == MODE_TIMED, will set timer and turn off output
 //         when timer expires
 //
+// NOTE: With a ramp mode set, turning off ramps the power down first. The output stays
+//         on (TransducerCurr.On) until the ramp finishes. EStop always stops at once.
+//
+// NOTE: Won't turn on while the supply is under voltage (see SUPPLY_MIN_VOLTS)
+//
 void TransducerOn(bool On);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRetry - Turn the output back on after a fault
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// As TransducerOn(true), but continues the run that the fault stopped: the energy
+//   delivered so far is kept, so a RUN_ENERGY dose isn't started over.
+//
+// NOTE: For the fault retry (see FaultUpdate()). Anything else uses TransducerOn().
+//
+void TransducerRetry(void);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -312,6 +636,136 @@ void TransducerFreq(uint16_t Freq);
 void TransducerPower(uint16_t Power);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerCurrent - Set transducer output current, for CTL_CONST_CURRENT mode
+//
+// Inputs:      Current to set, in amps*10 (ie: 15 means 1.5 amps)
+//              Slew limit on the setpoint, in amps*10 per second (0 == none)
+//
+// Outputs:     None.
+//
+// NOTE: The setpoint slews up from the measured current at each turn on, so a slew
+//         limit also gives a soft start.
+//
+void TransducerCurrent(uint16_t Current,uint16_t Slew);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerPwrGains - Set power regulator gains
+//
+// Inputs:      Proportional gain (1/256ths of a wiper count per watt x 10)
+//              Integral     gain (1/256ths of a wiper count per watt x 10 per frame)
+//              Deadband          (watts x 10)
+//
+// Outputs:     None.
+//
+//
+void TransducerPwrGains(uint8_t Kp,uint8_t Ki,uint8_t Deadband);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerResetMap - Forget the learned power map
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+// NOTE: Only changes the RAM copy. The EEPROM is updated the next time the transducer
+//         is off.
+//
+void TransducerResetMap(void);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDrift - Set thermal drift model
+//
+// Inputs:      Freq drift per sec of on time (mHz)
+//              Freq drift per kJ delivered   (mHz)
+//              Limit on drift correction (Hz, 0 == no correction)
+//
+// Outputs:     None.
+//
+void TransducerDrift(int16_t PerSec,int16_t PerKJ,uint8_t Max);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerThermal - Set stack thermal model
+//
+// Inputs:      Rated current (amps x 10, 0 == no model)
+//              Heating time constant (secs, at least 1)
+//              Cooling time constant (secs, at least 1)
+//              Heat to start derating at (% of rated)
+//              Heat to trip at (% of rated, more than the derate level)
+//
+// Outputs:     None.
+//
+// NOTE: The modelled heat carries on from where it was
+//
+void TransducerThermal(uint8_t Rated,uint16_t Heat,uint16_t Cool,uint8_t Derate,uint8_t Trip);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDriftFit - Fit the thermal drift model from a tracked run
+//
+// Inputs:      TRUE  to start collecting data
+//              FALSE to stop, and fit the model
+//
+// Outputs:     Number of samples collected
+//
+// Data is collected once a second while running in CTL_MAX_EFF and locked onto
+//   resonance, as (on time, energy, frequency) relative to the first sample.
+//
+// At one power level on time and energy rise together and can't be told apart, so
+//   the fit solves for DriftEnergy, taking DriftTime as already set (usually 0). If
+//   fewer than DRIFT_FIT_MIN_SAMPLES were taken, the model is left unchanged.
+//
+uint16_t TransducerDriftFit(bool Run);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerLoad - Set load classifier policy and references
+//
+// Inputs:      What to do when dry or overloaded (LOAD_FLAG,LOAD_DERATE,LOAD_STOP)
+//              Load signature running dry  (0 == uncalibrated)
+//              Load signature under normal load
+//
+// Outputs:     None.
+//
+void TransducerLoad(TRANSDUCER_LOAD_POLICY Policy,uint16_t Dry,uint16_t Normal);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerLoadCal - Calibrate the load classifier
+//
+// Inputs:      LOAD_DRY     to measure the dry reference
+//              LOAD_OK      to measure the normal load reference
+//              LOAD_UNKNOWN to forget the calibration
+//
+// Outputs:     None.
+//
+// The reference is measured over the next LOAD_CAL_FRAMES frames with the output on
+//   and enough drive to tell, and TransducerCurr.LoadCal is set until then. Nothing
+//   is done about the load state while calibrating.
+//
+void TransducerLoadCal(TRANSDUCER_LOAD Ref);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -326,17 +780,129 @@ void TransducerPower(uint16_t Power);
 void TransducerRunMode(TRANSDUCER_RUN_MODE RunMode,uint16_t Ticks);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerPulse - Set pulse timing, for RUN_PULSED mode
+//
+// Inputs:      On  time of each pulse (ms)
+//              Off time between pulses (ms)
+//              Number of pulses to run (0 == until turned off)
+//
+// Outputs:     None.
+//
+// NOTE: Pulse edges fall on control ticks (see Control.h), so times are rounded to
+//         the control tick.
+//
+void TransducerPulse(uint16_t OnMS,uint16_t OffMS,uint16_t Count);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDose - Set energy dose, for RUN_ENERGY mode
+//
+// Inputs:      Energy to deliver (joules)
+//
+// Outputs:     None.
+//
+void TransducerDose(uint32_t Joules);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerGetEnergy - Return energy delivered in the current (or last) run
+//
+// Inputs:      None.
+//
+// Outputs:     Energy delivered (joules)
+//
+// NOTE: Energy is integrated by the control tick, so use this rather than reading
+//         TransducerCurr.Energy directly.
+//
+uint32_t TransducerGetEnergy(void);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
 // TransducerCtlMode - Set transducer ctl mode
 //
-// Inputs:      Ctl mode (CTL_CONST_FREQ,CTL_MAX_EFF)
+// Inputs:      Ctl mode (CTL_CONST_FREQ,CTL_MAX_EFF,CTL_FREQ_MOD,CTL_CONST_CURRENT)
 //
 // Outputs:     None.
 //
 //
 void TransducerCtlMode(TRANSDUCER_CTL_MODE CtlMode);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerDither - Set FM dither, for CTL_FREQ_MOD mode
+//
+// Inputs:      Deviation either side of TransducerSet.Freq (Hz)
+//              Sweep rate, full cycles per second (Hz)
+//              Sweep shape (DITHER_TRIANGLE,DITHER_RANDOM)
+//
+// Outputs:     None.
+//
+// NOTE: Random sweeps move at the same speed as triangle ones, so on average cover
+//         the same ground at the same rate.
+//
+void TransducerDither(uint16_t Dev,uint8_t Rate,TRANSDUCER_DITHER_WAVE Wave);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerTrackStep - Set resonance tracking step
+//
+// Inputs:      Frequency step used by CTL_MAX_EFF tracking (Hz)
+//
+// Outputs:     None.
+//
+//
+void TransducerTrackStep(uint8_t TrackStep);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRetune - Set limit on headroom retune
+//
+// Inputs:      Furthest to move the frequency when power limited (Hz, 0 == off)
+//
+// Outputs:     None.
+//
+void TransducerRetune(uint8_t RetuneMax);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerAcquire - Enable/disable resonance search at turn on
+//
+// Inputs:      TRUE to search for resonance at turn on
+//
+// Outputs:     None.
+//
+void TransducerAcquire(bool Acquire);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerRamp - Set soft start/stop profile
+//
+// Inputs:      Ramp mode (RAMP_NONE,RAMP_LINEAR,RAMP_SCURVE)
+//              Time to ramp between zero and full power (ms)
+//
+// Outputs:     None.
+//
+//
+void TransducerRamp(TRANSDUCER_RAMP_MODE RampMode,uint16_t RampTime);
 
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -352,6 +918,29 @@ void TransducerCtlMode(TRANSDUCER_CTL_MODE CtlMode);
 void TransducerSetup(void);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerSwitch - Switch to a new setup
+//
+// Inputs:      Setup to switch to
+//
+// Outputs:     None.
+//
+// When off, this is the same as copying the setup to TransducerSet and calling
+//   TransducerSetup().
+//
+// When running, the frequency and power setpoints slew to the new setup (see
+//   SWITCH_FREQ_SLEW), then the rest of the setup is put in with the output still
+//   running. Modes that haven't changed carry on undisturbed, so a max efficiency
+//   run keeps the resonance it's tracking.
+//
+// TransducerCurr.Switching is set until the new setup is in, and the setup must stay
+//   put until then (the ones in EEPROM.Setups do).
+//
+void TransducerSwitch(TRANSDUCER_SET *Setup);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -366,6 +955,34 @@ void TransducerSetup(void);
 void TransducerUpdate(void);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerCalcPower - Calculate output power
+//
+// Inputs:      Current (amps x 100)
+//              Supply  (volts x 100)
+//              PWM     (% x 10)
+//
+// Outputs:     Power (watts x 10), no divides
+//
+uint16_t TransducerCalcPower(int16_t Current,uint16_t Volts,uint16_t PWM);
+
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerControl - Measure and drive the transducer
+//
+// Inputs:      None
+//
+// Outputs:     None.
+//
+// NOTE: Called by the control tick (see Control.h), not for public consumption
+//
+void TransducerControl(void);
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -379,4 +996,19 @@ void TransducerUpdate(void);
 bool TransducerCmd(char *Command);
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerWhyOff - Tell the user why the output didn't come on
+//
+// Inputs:      None.
+//
+// Outputs:     TRUE  if the output is off, and the reason was printed
+//              FALSE if the output is on
+//
+// NOTE: Call right after TransducerOn(true), as the ON and RC GO commands do
+//
+bool TransducerWhyOff(void);
+
+
 #endif  // DRIVER_H - entire file
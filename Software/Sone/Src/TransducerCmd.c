@@ -43,9 +43,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <avr/io.h>
+
 #include "Transducer.h"
+#include "ACS712.h"
+#include "ADC.h"
+#include "EEPROM.h"
+#include "Control.h"
+#include "Fault.h"
+#include "PWM.h"
 #include "Command.h"
 #include "Serial.h"
+#include "SerialLong.h"
+#include "UART.h"
 #include "MAScreen.h"
 #include "Parse.h"
 
@@ -56,7 +66,63 @@
 //
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// PrintMap - Print out the learned power map
+//
+// Inputs:      None.
+//
+// Outputs:     None.
+//
+static void PrintMap(void) {
+
+    StartMsg();
+    PrintStringP(PSTR("Power map (wiper by freq band and power):\r\n"));
+
+    PrintStringP(PSTR("       "));
+    for( uint8_t Point = 0; Point < PWR_MAP_POINTS; Point++ )
+        PrintD((uint16_t) Point << PWR_MAP_POINT_SHIFT,5);
+    PrintCRLF();
+
+    for( uint8_t Band = 0; Band < PWR_MAP_BANDS; Band++ ) {
+        PrintD(TRANSDUCER_MIN_FREQ + ((uint16_t) Band << PWR_MAP_BAND_SHIFT),5);
+        PrintStringP(PSTR(": "));
+        for( uint8_t Point = 0; Point < PWR_MAP_POINTS; Point++ )
+            PrintD(EEPROM.PwrMap.Wiper[Band][Point],5);
+        PrintCRLF();
+        }
+    }
+
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//
+// TransducerWhyOff - Tell the user why the output didn't come on
+//
+// Inputs:      None.
+//
+// Outputs:     TRUE  if the output is off, and the reason was printed
+//              FALSE if the output is on
+//
+bool TransducerWhyOff(void) {
+
+    if( TransducerCurr.On )
+        return false;
+
+    StartMsg();
+
+    if     ( TransducerCurr.EStop     ) PrintStringP(PSTR("Can't output while EStopped\007"));
+    else if( TransducerCurr.UnderVolt ) PrintStringP(PSTR("Can't output, supply under voltage\007"));
+    else if( TransducerCurr.Hot       ) PrintStringP(PSTR("Can't output, stack too hot (TM to check)\007"));
+    else if( FaultLatched()           ) PrintStringP(PSTR("Can't output, fault latched (FL to list, RE to reset)\007"));
+    else                                PrintStringP(PSTR("Can't output\007"));
+
+    return true;
+    }
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //
@@ -88,13 +154,10 @@ PrintStringP(PSTR("Transducer OFF"));
         TransducerOn(true);
 
         //
-        // If EStopped, let the user know we can't start.
+        // If we couldn't start (EStopped, for instance), let the user know why.
         //
-        if( TransducerCurr.EStop ) {
-            StartMsg();
-            PrintStringP(PSTR("Can't output while EStopped\007"));
+        if( TransducerWhyOff() )
             return true;
-            }
 
 StartMsg();
 PrintStringP(PSTR("Transducer ON"));
@@ -117,9 +180,41 @@ PrintStringP(PSTR("Reset: EStop ON"));
     // RE - Reset estop
     //
     if( StrEQ(Command,"RE") ) {
+        bool Tripped = TransducerCurr.Tripped;
+
         TransducerEStop(false);
 StartMsg();
 PrintStringP(PSTR("Reset: EStop OFF"));
+        if( Tripped )
+            PrintStringP(PSTR(", overcurrent trip cleared"));
+        return true;
+        }
+
+
+    //
+    // OC - Print overcurrent trip count and peak current, or OC C to clear them
+    //
+    if( StrEQ(Command,"OC") ) {
+
+        if( StrEQ(ParseToken(),"C") )
+            ACS712ClearPeak();
+
+        int16_t Peak = ACS712GetPeak();
+
+        StartMsg();
+        PrintStringP(PSTR("Overcurrent trips: "));
+        PrintD(ACS712GetTrips(),0);
+        PrintStringP(PSTR(", peak "));
+        PrintSD(Peak/10,0);
+        PrintChar('.');
+        PrintD((Peak < 0 ? -Peak : Peak)%10,0);
+        PrintStringP(PSTR(" amps, trip at "));
+        PrintD(ACS712_TRIP_CURRENT/10,0);
+        PrintChar('.');
+        PrintD(ACS712_TRIP_CURRENT%10,0);
+        PrintStringP(PSTR(" amps"));
+        if( TransducerCurr.Tripped )
+            PrintStringP(PSTR(" (TRIPPED)"));
         return true;
         }
 
@@ -184,6 +279,605 @@ PrintD(TransducerSet.Freq,0);
         return true;
         }
 
+    //
+    // PG - Set power regulator gains
+    //
+    if( StrEQ(Command,"PG") ) {
+        char *KpText = ParseToken();
+
+        //
+        // Accept a blank PG command as a request to print the gains
+        //
+        if( !strlen(KpText) ) {
+            StartMsg();
+            PrintStringP(PSTR("Kp "));
+            PrintD(TransducerSet.PwrKp,0);
+            PrintStringP(PSTR(", Ki "));
+            PrintD(TransducerSet.PwrKi,0);
+            PrintStringP(PSTR(", deadband "));
+            PrintD(TransducerSet.PwrDB,0);
+            return true;
+            }
+
+        char *KiText = ParseToken();
+        char *DBText = ParseToken();
+        int   KpNum  = atoi(KpText);
+        int   KiNum  = atoi(KiText);
+        int   DBNum  = TransducerSet.PwrDB;
+
+        if( strlen(DBText) )
+            DBNum = atoi(DBText);
+
+        if( !strlen(KiText)         ||
+            KpNum < 0 || KpNum > 255 ||
+            KiNum < 0 || KiNum > 255 ||
+            DBNum < 0 || DBNum > 255 ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range gains, must be Kp Ki [deadband], each 0 to 255\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        TransducerPwrGains(KpNum,KiNum,DBNum);
+        return true;
+        }
+
+    //
+    // DR - Thermal drift model: print, set, or fit from a tracked run
+    //
+    if( StrEQ(Command,"DR") ) {
+        char *PerSecText = ParseToken();
+
+        if( StrEQ(PerSecText,"F") ) {
+            TransducerDriftFit(true);
+            StartMsg();
+            PrintStringP(PSTR("Collecting drift data, run in max efficiency mode then DR E"));
+            return true;
+            }
+
+        if( StrEQ(PerSecText,"E") ) {
+            uint16_t Samples = TransducerDriftFit(false);
+
+            StartMsg();
+            PrintD(Samples,0);
+            PrintStringP(PSTR(" drift samples"));
+            if( Samples < DRIFT_FIT_MIN_SAMPLES ) {
+                PrintStringP(PSTR(", need "));
+                PrintD(DRIFT_FIT_MIN_SAMPLES,0);
+                PrintStringP(PSTR(" to fit\r\n"));
+                return true;
+                }
+            PrintStringP(PSTR(", fit "));
+            PrintSD(TransducerSet.DriftEnergy,0);
+            PrintStringP(PSTR("mHz/kJ"));
+            return true;
+            }
+
+        //
+        // Accept a blank DR command as a request to print the model
+        //
+        if( !strlen(PerSecText) ) {
+            StartMsg();
+            PrintSD(TransducerSet.DriftTime,0);
+            PrintStringP(PSTR("mHz/sec, "));
+            PrintSD(TransducerSet.DriftEnergy,0);
+            PrintStringP(PSTR("mHz/kJ, max "));
+            PrintD(TransducerSet.DriftMax,0);
+            PrintStringP(PSTR("Hz, now "));
+            PrintSD(TransducerCurr.Drift,0);
+            PrintStringP(PSTR("Hz"));
+            return true;
+            }
+
+        char *PerKJText = ParseToken();
+        char *MaxText   = ParseToken();
+        long  PerSec    = atol(PerSecText);
+        long  PerKJ     = atol(PerKJText);
+        long  Max       = TransducerSet.DriftMax;
+
+        if( strlen(MaxText) )
+            Max = atol(MaxText);
+
+        if( !strlen(PerKJText)                ||
+            PerSec < -32767 || PerSec > 32767 ||
+            PerKJ  < -32767 || PerKJ  > 32767 ||
+            Max    < 0      || Max    > 255    ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range drift, must be mHz/sec mHz/kJ [max Hz]\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        TransducerDrift(PerSec,PerKJ,Max);
+        return true;
+        }
+
+    //
+    // PW - Print PWM capture statistics for the last frame
+    //
+    if( StrEQ(Command,"PW") ) {
+        PWM_STATS Stats;
+
+        DISABLE_CONTROL;
+        PWMGetStats(&Stats);
+        ENABLE_CONTROL;
+
+        StartMsg();
+        PrintD(Stats.Cycles,0);
+        PrintStringP(PSTR(" cycles, "));
+        PrintD(Stats.Lost,0);
+        PrintStringP(PSTR(" lost, period "));
+        PrintD(Stats.MinPeriod,0);
+        PrintChar('-');
+        PrintD(Stats.MaxPeriod,0);
+        PrintStringP(PSTR(" clocks, jitter "));
+        PrintD(Stats.Jitter,0);
+        PrintStringP(PSTR("ns, PWM "));
+        PrintD(Stats.MinPWM/10,0);
+        PrintChar('.');
+        PrintD(Stats.MinPWM%10,0);
+        PrintChar('-');
+        PrintD(Stats.MaxPWM/10,0);
+        PrintChar('.');
+        PrintD(Stats.MaxPWM%10,0);
+        PrintChar('%');
+        return true;
+        }
+
+#ifdef USE_PWM_CAPTURE
+    //
+    // CP - Raw PWM capture: print state, arm, trigger, or dump
+    //
+    if( StrEQ(Command,"CP") ) {
+        char *CaptText = ParseToken();
+
+        if( StrEQ(CaptText,"A") ) {
+            char *TrigText = ParseToken();
+
+            if     ( StrEQ(TrigText,"S") ) PWMCaptArm(TRIG_START);
+            else if( StrEQ(TrigText,"L") ) PWMCaptArm(TRIG_LOST);
+            else if( !strlen(TrigText)   ) PWMCaptArm(TRIG_NOW);
+            else {
+                StartMsg();
+                PrintStringP(PSTR("Unrecognized capture trigger ("));
+                PrintString(TrigText);
+                PrintStringP(PSTR("), must be S, L, or nothing.\r\n"));
+                PrintStringP(PSTR("Type '?' for help\r\n"));
+                }
+            return true;
+            }
+
+        if( StrEQ(CaptText,"T") ) {
+            PWMCaptTrigger();
+            return true;
+            }
+
+        //
+        // Binary dump, for a program on the other end:
+        //
+        //   'C' 'P' Count Trig { PeriodLo PeriodHi HighLo HighHi } x Count Sum
+        //
+        // Trig is the index of the first entry after the trigger, and Sum is the low
+        //   byte of the sum of all the bytes after 'C' 'P'.
+        //
+        if( StrEQ(CaptText,"D") ) {
+            uint8_t  Count = PWMCaptCount();
+            uint8_t  Trig  = PWMCaptTrig();
+            uint8_t  Sum   = Count + Trig;
+            PWM_CAPT Entry;
+
+            if( PWMCaptState() != CAPT_FROZEN )
+                Count = Trig = Sum = 0;
+
+            PutUARTByteW('C');
+            PutUARTByteW('P');
+            PutUARTByteW(Count);
+            PutUARTByteW(Trig);
+
+            for( uint8_t Index = 0; Index < Count; Index++ ) {
+                PWMCaptGet(Index,&Entry);
+
+                uint8_t *Bytes = (uint8_t *) &Entry;
+
+                for( uint8_t Byte = 0; Byte < sizeof(Entry); Byte++ ) {
+                    PutUARTByteW(Bytes[Byte]);
+                    Sum += Bytes[Byte];
+                    }
+                }
+
+            PutUARTByteW(Sum);
+            return true;
+            }
+
+        if( strlen(CaptText) ) {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized capture command ("));
+            PrintString(CaptText);
+            PrintStringP(PSTR("), must be A [S|L], T, D, or nothing.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Capture "));
+        switch(PWMCaptState()) {
+            case CAPT_IDLE:      PrintStringP(PSTR("idle"));      break;
+            case CAPT_ARMED:     PrintStringP(PSTR("armed"));     break;
+            case CAPT_TRIGGERED: PrintStringP(PSTR("triggered")); break;
+            case CAPT_FROZEN:    PrintStringP(PSTR("frozen"));    break;
+            }
+        PrintStringP(PSTR(", "));
+        PrintD(PWMCaptCount(),0);
+        PrintStringP(PSTR(" cycles"));
+        if( PWMCaptState() == CAPT_FROZEN ) {
+            PrintStringP(PSTR(", trigger at "));
+            PrintD(PWMCaptTrig(),0);
+            }
+        return true;
+        }
+#endif
+
+    //
+    // GT - Print gated frequency, or set the gate time
+    //
+    if( StrEQ(Command,"GT") ) {
+        char *GateText = ParseToken();
+
+        if( strlen(GateText) ) {
+            long Gate = atol(GateText);
+
+            if( Gate < PWM_GATE_MIN_MS || Gate > PWM_GATE_MAX_MS ) {
+                StartMsg();
+                PrintStringP(PSTR("Bad or out of range gate, must be 10 to 1000 ms\r\n"));
+                PrintStringP(PSTR("Type '?' for help\r\n"));
+                return true;
+                }
+
+            PWMGate(Gate);
+            return true;
+            }
+
+        uint32_t FineFreq = PWMGetGateFreq();
+
+        //
+        // Print the fraction to 3 places
+        //
+        uint16_t Frac = ((FineFreq & 0xFFFF)*1000 + 32768) >> 16;
+        uint16_t Freq = FineFreq >> 16;
+
+        if( Frac >= 1000 ) {
+            Frac -= 1000;
+            Freq++;
+            }
+
+        StartMsg();
+        PrintD(Freq,0);
+        PrintChar('.');
+        PrintD(Frac,103);
+        PrintStringP(PSTR(" Hz"));
+        return true;
+        }
+
+    //
+    // TM - Stack thermal model: print, or set
+    //
+    if( StrEQ(Command,"TM") ) {
+        char *RatedText = ParseToken();
+
+        //
+        // Accept a blank TM command as a request to print the model
+        //
+        if( !strlen(RatedText) ) {
+            StartMsg();
+            if( TransducerSet.ThermRated == 0 ) {
+                PrintStringP(PSTR("Thermal model off"));
+                return true;
+                }
+            PrintD(TransducerSet.ThermRated,0);
+            PrintStringP(PSTR(" amps x 10, heat "));
+            PrintD(TransducerSet.ThermHeat,0);
+            PrintStringP(PSTR("/cool "));
+            PrintD(TransducerSet.ThermCool,0);
+            PrintStringP(PSTR(" secs, derate "));
+            PrintD(TransducerSet.ThermDerate,0);
+            PrintStringP(PSTR("%/trip "));
+            PrintD(TransducerSet.ThermTrip,0);
+            PrintStringP(PSTR("%, now "));
+            PrintD(TransducerCurr.Heat,0);
+            PrintChar('%');
+            if( TransducerCurr.Hot )
+                PrintStringP(PSTR(" (hot)"));
+            return true;
+            }
+
+        long  Rated  = atol(RatedText);
+
+        if( Rated == 0 ) {
+            TransducerThermal(0,TransducerSet.ThermHeat,TransducerSet.ThermCool,
+                                TransducerSet.ThermDerate,TransducerSet.ThermTrip);
+            return true;
+            }
+
+        char *HeatText   = ParseToken();
+        char *CoolText   = ParseToken();
+        char *DerateText = ParseToken();
+        char *TripText   = ParseToken();
+        long  Heat       = atol(HeatText);
+        long  Cool       = atol(CoolText);
+        long  Derate     = TransducerSet.ThermDerate;
+        long  Trip       = TransducerSet.ThermTrip;
+
+        if( strlen(DerateText) ) {
+            Derate = atol(DerateText);
+            Trip   = atol(TripText);
+            }
+
+        if( !strlen(CoolText)                 ||
+            Rated  < 1      || Rated  > 255   ||
+            Heat   < 1      || Heat   > 65535 ||
+            Cool   < 1      || Cool   > 65535 ||
+            Derate < 1      || Trip   > 250   || Derate >= Trip ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range thermal model, must be amps x 10 heat secs cool secs [derate% trip%]\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        TransducerThermal(Rated,Heat,Cool,Derate,Trip);
+        return true;
+        }
+
+    //
+    // LC - Load classifier: print, or calibrate dry/normal, or clear
+    //
+    if( StrEQ(Command,"LC") ) {
+        char *RefText = ParseToken();
+
+        if( StrEQ(RefText,"D") || StrEQ(RefText,"N") ) {
+            TransducerLoadCal(StrEQ(RefText,"D") ? LOAD_DRY : LOAD_OK);
+            StartMsg();
+            PrintStringP(PSTR("Calibrating "));
+            if( StrEQ(RefText,"D") ) PrintStringP(PSTR("dry"));
+            else                     PrintStringP(PSTR("normal"));
+            PrintStringP(PSTR(" load, run the transducer then LC to check"));
+            return true;
+            }
+
+        if( StrEQ(RefText,"C") ) {
+            TransducerLoadCal(LOAD_UNKNOWN);
+            StartMsg();
+            PrintStringP(PSTR("Load calibration cleared"));
+            return true;
+            }
+
+        if( strlen(RefText) ) {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized load calibration ("));
+            PrintString(RefText);
+            PrintStringP(PSTR("), must be D, N, C, or nothing.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        StartMsg();
+        PrintStringP(PSTR("Load: dry "));
+        PrintD(TransducerSet.LoadDry,0);
+        PrintStringP(PSTR(", normal "));
+        PrintD(TransducerSet.LoadNormal,0);
+        PrintStringP(PSTR(", now "));
+        PrintD(TransducerCurr.LoadSig,0);
+        if( TransducerCurr.LoadCal )
+            PrintStringP(PSTR(" (calibrating)"));
+        return true;
+        }
+
+    //
+    // FL - Print fault state and history, or FL C to clear the history
+    //
+    if( StrEQ(Command,"FL") ) {
+
+        if( StrEQ(ParseToken(),"C") )
+            FaultClearLog();
+
+        uint8_t Latched = FaultLatched();
+        uint8_t Pending = FaultPending();
+
+        StartMsg();
+        PrintStringP(PSTR("Faults:"));
+        for( uint8_t Index = 0; Index < NUM_FAULTS; Index++ ) {
+            FAULT Fault = FAULT_OVERCURRENT + Index;
+
+            if( (Latched | Pending) & FAULT_BIT(Fault) ) {
+                PrintChar(' ');
+                PrintFault(Fault);
+                if( Latched & FAULT_BIT(Fault) ) PrintStringP(PSTR(" (latched)"));
+                else                             PrintStringP(PSTR(" (retry)"));
+                }
+            }
+        if( !(Latched | Pending) )
+            PrintStringP(PSTR(" none"));
+        if( Pending ) {
+            PrintStringP(PSTR(", retry in "));
+            PrintD(FaultRetryIn(),0);
+            PrintStringP(PSTR(" secs"));
+            }
+        PrintCRLF();
+
+        FAULT_LOG Log;
+
+        for( uint8_t Entry = 0; FaultGetLog(Entry,&Log); Entry++ ) {
+            PrintStringP(PSTR("  "));
+            PrintLD(Log.Secs,0);
+            PrintStringP(PSTR(" secs: "));
+            PrintFault(Log.Fault);
+            if( Log.Retry ) {
+                PrintStringP(PSTR(", retry "));
+                PrintD(Log.Retry,0);
+                }
+            PrintCRLF();
+            }
+        return true;
+        }
+
+    //
+    // CA - Current and supply calibration: print, zero, gain, or clear
+    //
+    if( StrEQ(Command,"CA") ) {
+        char *CalText = ParseToken();
+        bool  Good    = true;
+
+        if( StrEQ(CalText,"Z") ) {
+            if( TransducerCurr.On ) {
+                StartMsg();
+                PrintStringP(PSTR("Turn the transducer off to zero the current\007"));
+                return true;
+                }
+            Good = ACS712CalZero();
+            }
+
+        else if( StrEQ(CalText,"I") ) Good = ACS712CalCurrent(atoi(ParseToken()));
+        else if( StrEQ(CalText,"V") ) Good = ACS712CalSupply (atol(ParseToken()));
+        else if( StrEQ(CalText,"C") ) ACS712ResetCal();
+
+        else if( strlen(CalText) ) {
+            StartMsg();
+            PrintStringP(PSTR("Unrecognized calibration ("));
+            PrintString(CalText);
+            PrintStringP(PSTR("), must be Z, I #, V #, C, or nothing.\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        if( !Good ) {
+            StartMsg();
+            PrintStringP(PSTR("Bad or out of range calibration, check the reading\r\n"));
+            PrintStringP(PSTR("Type '?' for help\r\n"));
+            return true;
+            }
+
+        if( strlen(CalText) )
+            EEPROMUpdate(&EEPROM.Cal,sizeof(EEPROM.Cal));
+
+        StartMsg();
+        PrintStringP(PSTR("Cal: zero "));
+        PrintD(EEPROM.Cal.CurrentZero,0);
+        PrintStringP(PSTR(", current gain "));
+        PrintD(EEPROM.Cal.CurrentGain,0);
+        PrintStringP(PSTR(", supply gain "));
+        PrintD(EEPROM.Cal.SupplyGain,0);
+        PrintCRLF();
+        PrintStringP(PSTR("Now: "));
+        PrintD(ACS712GetCounts(),0);
+        PrintStringP(PSTR(" counts, "));
+        PrintD(ACS712GetSupplyCounts(),0);
+        PrintStringP(PSTR(" supply counts"));
+        return true;
+        }
+
+    //
+    // AD - Print AtoD channel readings
+    //
+    if( StrEQ(Command,"AD") ) {
+        uint16_t Current;
+        uint16_t Supply;
+        uint16_t Tuning;
+        uint16_t Vcc;
+        int16_t  Temp;
+
+        DISABLE_CONTROL;
+        Current = ADCPeekCounts(ADC_CURRENT);
+        Supply  = ADCPeekCounts(ADC_SUPPLY);
+        Tuning  = ADCPeekCounts(ADC_TUNING);
+        ENABLE_CONTROL;
+
+        Vcc     = ADCGetVcc();
+        Temp    = ADCGetTemp();
+
+        StartMsg();
+        PrintStringP(PSTR("Counts x 64: current "));
+        PrintD(Current,0);
+        PrintStringP(PSTR(", supply "));
+        PrintD(Supply,0);
+        PrintStringP(PSTR(", tuning "));
+        PrintD(Tuning,0);
+        PrintCRLF();
+        PrintStringP(PSTR("Vcc "));
+        PrintD(Vcc/100,0);
+        PrintChar('.');
+        PrintD(Vcc%100,102);
+        PrintStringP(PSTR("V, chip "));
+        PrintSD(Temp,0);
+        PrintChar('C');
+        return true;
+        }
+
+    //
+    // BM - Benchmark the control tick and power calculation
+    //
+    // Times the old (divide) and current (reciprocal) conversion from AtoD totals to
+    //   power, on typical values, using Timer1 which counts CPU cycles (see PWM.c).
+    //   Interrupts are left on, so take the best of a few tries.
+    //
+    if( StrEQ(Command,"BM") ) {
+        volatile uint16_t   Total   = 3300;         // 6 readings, about 2 amps
+        volatile uint16_t   Supply  = 3700;         // 6 readings, about 12 volts
+        volatile uint8_t    Cycles  = 6;
+        volatile uint16_t   PWM     = 800;
+        volatile uint16_t   Result;
+        uint16_t            Old     = UINT16_MAX;
+        uint16_t            New     = UINT16_MAX;
+
+        for( uint8_t Try = 0; Try < 8; Try++ ) {
+            uint16_t Start = TCNT1;
+            int16_t  Current = (((int32_t) Total)*500)/(1023L*Cycles) - 250;
+            uint16_t Volts   = ((uint32_t) Supply*500*(SUPPLY_R1+SUPPLY_R2))/
+                               ((uint32_t) 1023*Cycles*SUPPLY_R2);
+            Result = ((uint32_t) Current*Volts*PWM)/100000;
+            uint16_t Cycles1 = TCNT1 - Start;
+
+            Start   = TCNT1;
+            Current = ACS712ToCurrentFine(ACS712Average(Total,Cycles,0));
+            Volts   = ACS712ToSupply (ACS712Average(Supply,Cycles,0));
+            Result  = TransducerCalcPower(Current,Volts,PWM);
+            uint16_t Cycles2 = TCNT1 - Start;
+
+            if( Cycles1 < Old ) Old = Cycles1;
+            if( Cycles2 < New ) New = Cycles2;
+            }
+
+        (void) Result;
+
+        StartMsg();
+        PrintStringP(PSTR("Power calc: "));
+        PrintD(Old,0);
+        PrintStringP(PSTR(" cycles with divides, "));
+        PrintD(New,0);
+        PrintStringP(PSTR(" without"));
+        PrintCRLF();
+        PrintStringP(PSTR("Control tick: "));
+        PrintD(ControlGetMaxCycles(),0);
+        PrintStringP(PSTR(" cycles max"));
+        ControlClearCycles();
+        return true;
+        }
+
+    //
+    // PM - Print power map, or PM C to clear it
+    //
+    if( StrEQ(Command,"PM") ) {
+        char *MapText = ParseToken();
+
+        if( StrEQ(MapText,"C") ) {
+            TransducerResetMap();
+            StartMsg();
+            PrintStringP(PSTR("Power map cleared"));
+            return true;
+            }
+
+        PrintMap();
+        return true;
+        }
+
     //////////////////////////////////////////////////////////////////////////////////////
     //
     // ADJ COMMANDS
@@ -271,7 +965,7 @@ PrintD(TransducerSet.Freq,0);
             return true;
             }
 
-        PWMPotSetWiper(TransducerCurr.PWMWiper = PowerNum);
+        TransducerCurr.PWMWiper = PowerNum;
         return true;
         }
 #endif // USE_WIPER_CMDS
@@ -327,8 +1021,12 @@ void ProcessInput1(bool Input1On) {
         // ESTOP when triggered
         //
         case INPUT_ESTOP:
-            if( Input1On )
+            if( Input1On ) {
+                DISABLE_CONTROL;
+                FaultRaise(FAULT_ESTOP);
+                ENABLE_CONTROL;
                 TransducerEStop(true);
+                }
             break;
         }
     }
@@ -370,8 +1068,12 @@ void ProcessInput2(bool Input2On) {
         // ESTOP when triggered
         //
         case INPUT_ESTOP:
-            if( Input2On )
+            if( Input2On ) {
+                DISABLE_CONTROL;
+                FaultRaise(FAULT_ESTOP);
+                ENABLE_CONTROL;
                 TransducerEStop(true);
+                }
             break;
         }
     }